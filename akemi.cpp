@@ -3,6 +3,25 @@
 #include <vector>
 #include <usb.h>
 #include <cp210x.h>
+#include <awaitable.h>
+
+#if AKEMI_COROUTINES
+static coro::task<> get_sn_loop(cp210x &cp, coro::chunk_reader &reader,
+                                uint8_t *request, size_t len)
+{
+	for(;;) {
+		coro::io_result sent = co_await coro::send(cp,request,len);
+		fprintf(stderr,"data_sent[%i][%zu]\n",sent.status,sent.length);
+		
+		coro::chunk reply = co_await reader.next();
+		auto bytes_str = usb::format_bytes(reply.buffer.data(),reply.buffer.size());
+		fprintf(stderr,"data_received[%i][%s]\n",reply.status,bytes_str.get());
+		if(reply.status) {
+			co_return;
+		}
+	}
+}
+#endif
 
 int main(int argc, char **argv)
 {
@@ -22,6 +41,10 @@ int main(int argc, char **argv)
 	
 	uint8_t get_sn_request[] = {0xff,0,0x10,0,0x10,0xcc};		
 	
+#if AKEMI_COROUTINES
+	coro::chunk_reader reader(cp);
+	get_sn_loop(cp,reader,get_sn_request,sizeof(get_sn_request)).detach();
+#else
 	auto send_handler = [](int status, size_t len) {
 		fprintf(stderr,"data_sent[%i][%i]\n",status,len);	
 	};
@@ -37,7 +60,7 @@ int main(int argc, char **argv)
 	
 	cp.recv_async();
 	cp.send_async(get_sn_request,sizeof(get_sn_request),send_handler);
-	
+#endif
 	
 	sleep(60);
 	
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <dmx_compress.h>
+
+// payload bytes of a dmx_stream::buffer_t
+#define FRAME_PAYLOAD 62
+
+typedef std::vector<uint8_t> sample_t;
+
+static void append(sample_t &s, const char *text) {
+	s.insert(s.end(),text,text + strlen(text));
+}
+
+// for control sequences with NUL bytes
+template<size_t N>
+static void append_bytes(sample_t &s, const char (&bytes)[N]) {
+	s.insert(s.end(),bytes,bytes + N - 1);
+}
+
+// customer display: two 20 column lines redrawn for every item scanned
+static sample_t screen_sample() {
+	static const char *items[] = {
+		"MILK 1L", "BREAD", "COFFEE 250G", "APPLES", "WATER 6X1.5L", "BUTTER", "EGGS 10", "RICE 1KG"
+	};
+
+	sample_t s;
+	char line[128];
+	unsigned total = 0;
+	for(unsigned i = 0; i < 200; i++) {
+		const unsigned price = 59 + (i * 137) % 900;
+		total += price;
+		append(s,"\x1b[2J\x1b[H");
+		snprintf(line,sizeof(line),"%-14s%3u.%02u\r\n",items[i % 8],price / 100,price % 100);
+		append(s,line);
+		snprintf(line,sizeof(line),"TOTAL %10u.%02u\r\n",total / 100,total % 100);
+		append(s,line);
+	}
+	return s;
+}
+
+// ESC/POS receipts
+static sample_t printer_sample() {
+	sample_t s;
+	char line[128];
+	for(unsigned r = 0; r < 20; r++) {
+		append_bytes(s,"\x1b@\x1b" "a\x01\x1d!\x11" "AKEMI STORE\n\x1d!\x00" "Main Street 1\n\x1b" "a\x00");
+		snprintf(line,sizeof(line),"Receipt %06u      2026-10-%02u %02u:%02u\n",1000 + r,1 + r % 28,8 + r % 12,r * 7 % 60);
+		append(s,line);
+		append(s,"------------------------------------------\n");
+		unsigned total = 0;
+		for(unsigned i = 0; i < 5 + r % 7; i++) {
+			const unsigned price = 99 + (r * 31 + i * 173) % 2000;
+			total += price;
+			snprintf(line,sizeof(line),"%2u x Item %-4u %21u.%02u\n",1 + i % 3,(r * 13 + i) % 500,price / 100,price % 100);
+			append(s,line);
+		}
+		append(s,"------------------------------------------\n");
+		snprintf(line,sizeof(line),"\x1b" "E\x01TOTAL %34u.%02u\n",total / 100,total % 100);
+		append(s,line);
+		append_bytes(s,"\x1b" "E\x00\nThank you for your visit!\n\n\n\x1dV\x01");
+	}
+	return s;
+}
+
+// ESC/POS raster logo, 384 dots wide: a ring around horizontal bars
+static sample_t bitmap_sample() {
+	const unsigned width = 384 / 8, height = 160;
+
+	sample_t s;
+	const uint8_t header[] = { 0x1d, 'v', '0', 0, width, 0, height, 0 };
+	s.insert(s.end(),header,header + sizeof(header));
+	for(unsigned y = 0; y < height; y++) {
+		for(unsigned x = 0; x < width; x++) {
+			uint8_t byte = 0;
+			for(unsigned bit = 0; bit < 8; bit++) {
+				const int dx = (int)(x * 8 + bit) - 192, dy = (int)y - 80;
+				const int r2 = dx * dx + dy * dy;
+				const bool ring = r2 > 60 * 60 && r2 < 75 * 75;
+				const bool bar = dx > -50 && dx < 50 && (y / 10) % 2 == 0 && y > 40 && y < 120;
+				if(ring || bar) byte |= 0x80 >> bit;
+			}
+			s.push_back(byte);
+		}
+	}
+	return s;
+}
+
+// nothing to find, the worst case
+static sample_t random_sample() {
+	sample_t s(16384);
+	uint32_t state = 2463534242u;
+	for(auto &b : s) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		b = state;
+	}
+	return s;
+}
+
+static bool file_sample(const char *path, sample_t &s) {
+	FILE *f = fopen(path,"rb");
+	if(!f) return false;
+
+	uint8_t buffer[4096];
+	size_t len;
+	while((len = fread(buffer,1,sizeof(buffer),f)) > 0) {
+		s.insert(s.end(),buffer,buffer + len);
+	}
+	fclose(f);
+	return true;
+}
+
+// codes sample in frames the way dmx_stream does and decodes them again,
+// false when the round trip does not give the sample back
+static bool run(const char *name, const sample_t &sample) {
+	dmx_encoder encoder;
+	dmx_decoder decoder;
+
+	std::vector< std::vector<uint8_t> > frames;
+	uint8_t frame[FRAME_PAYLOAD];
+	size_t coded = 0;
+
+	auto start = std::chrono::steady_clock::now();
+	for(size_t offset = 0; offset < sample.size(); ) {
+		size_t used;
+		const size_t len = encoder.encode(&sample[offset],sample.size() - offset,frame,sizeof(frame),used);
+		frames.push_back(std::vector<uint8_t>(frame,frame + len));
+		coded += len;
+		offset += used;
+	}
+	auto encoded = std::chrono::steady_clock::now();
+
+	sample_t plain;
+	uint8_t out[FRAME_PAYLOAD * DMX_MATCH_MAX / 2];
+	for(auto &f : frames) {
+		const int len = decoder.decode(&f[0],f.size(),out,sizeof(out));
+		if(len < 0) {
+			printf("%-10s decode failed after %zu bytes\n",name,plain.size());
+			return false;
+		}
+		plain.insert(plain.end(),out,out + len);
+	}
+	auto decoded = std::chrono::steady_clock::now();
+
+	if(plain != sample) {
+		printf("%-10s round trip differs\n",name);
+		return false;
+	}
+
+	const size_t plain_frames = (sample.size() + FRAME_PAYLOAD - 1) / FRAME_PAYLOAD;
+	const double encode_us = std::chrono::duration<double,std::micro>(encoded - start).count();
+	const double decode_us = std::chrono::duration<double,std::micro>(decoded - encoded).count();
+	printf("%-10s %8zu %8zu %8ld %6.1f%% %8zu %8zu %9.1f %9.1f\n",name,sample.size(),coded,
+	       (long)sample.size() - (long)coded,100.0 * coded / std::max<size_t>(sample.size(),1),
+	       plain_frames,frames.size(),sample.size() / std::max(encode_us,1e-3),
+	       sample.size() / std::max(decode_us,1e-3));
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	printf("%-10s %8s %8s %8s %7s %8s %8s %9s %9s\n","sample","bytes","coded","saved","ratio",
+	       "frames","coded fr","enc MB/s","dec MB/s");
+
+	bool ok = true;
+	if(argc > 1) {
+		for(int i = 1; i < argc; i++) {
+			sample_t s;
+			if(!file_sample(argv[i],s)) {
+				printf("Cannot read %s\n",argv[i]);
+				return 1;
+			}
+			const char *name = strrchr(argv[i],'/');
+			ok &= run(name ? name + 1 : argv[i],s);
+		}
+	} else {
+		ok &= run("screen",screen_sample());
+		ok &= run("printer",printer_sample());
+		ok &= run("bitmap",bitmap_sample());
+		ok &= run("random",random_sample());
+	}
+
+	return ok ? 0 : 2;
+}
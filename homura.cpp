@@ -7,11 +7,10 @@
 #include <dispatcher.h>
 #include <serial_stream.h>
 #include <usb.h>
-
-static const int log_level = getenv("DEBUG_HOMURA") != 0;
+#include <log.h>
 
 int main() {
-	usb::context context(3);
+	usb::context context(3,true);
 	if(!context) {
 		return 1;
 	}
@@ -23,12 +22,38 @@ int main() {
 		
 	boost::asio::io_service io_service;
 		
-	dispatcher d(context,io_service);
+	// HOMURA_REPLAY=<trace recorded with USB_TRACE> serves recorded traffic,
+	// HOMURA_REPLAY_FAST ignores the recorded timing,
+	// HOMURA_USB_THREAD handles libusb events on a separate thread,
+	// HOMURA_FRAMED speaks addr/len channels as madoka does, for adapter
+	// firmware that frames; otherwise bytes pass through unframed
+	const bool framed = getenv("HOMURA_FRAMED") != 0;
+	dispatcher d(context,io_service,getenv("HOMURA_REPLAY"),
+	             getenv("HOMURA_REPLAY_FAST") == 0,
+	             getenv("HOMURA_USB_THREAD") == 0,
+	             framed);
 	if(!d) {
-		std::cerr << "No device found" << std::endl;
+		LOG_ERROR(app,"No device found");
 		return 2;
 	}
 	
+	// HOMURA_COALESCE=<bytes> merges small client writes into transfers
+	// of up to that size, flushed after HOMURA_COALESCE_US (200) at most
+	if(const char *coalesce = getenv("HOMURA_COALESCE")) {
+		const char *deadline = getenv("HOMURA_COALESCE_US");
+		d.set_coalescing(strtoul(coalesce,0,0),deadline ? strtoul(deadline,0,0) : 200);
+	}
+	
+	// kill -USR1 logs latency percentiles and error counts
+	boost::asio::signal_set stats_signal(io_service,SIGUSR1);
+	boost::function<void (const boost::system::error_code&, int)> on_stats_signal;
+	on_stats_signal = [&](const boost::system::error_code &error, int) {
+		if(error) return;
+		d.log_stats();
+		stats_signal.async_wait(on_stats_signal);
+	};
+	stats_signal.async_wait(on_stats_signal);
+	
 	try {
 	/*    auto serial1 = boost::make_shared<serial_stream>(io_service,"/dev/ttyUSB0");
 	
@@ -40,12 +65,51 @@ int main() {
 		unix_server s2(io_service,d.get_stream(0),
 		               boost::asio::local::stream_protocol::endpoint("/tmp/cp"));*/
 		 
-		tcp_server server(io_service,d.get_stream(0),
+		if(!framed) {
+			// everything read arrives on stream 0
+			tcp_server server(io_service,d.get_stream(0),
+			                boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),1200));
+			
+			io_service.run();
+			return 0;
+		}
+		
+		// the channels of madoka, under homura's own socket names
+		const char *bar_socket = "/tmp/homura_bar";
+		const char *screen_socket = "/tmp/homura_screen";
+		const char *card_socket = "/tmp/homura_card";
+		const char *printer_socket = "/tmp/homura_printer";
+		::unlink(bar_socket);
+		::unlink(screen_socket);
+		::unlink(card_socket);
+		::unlink(printer_socket);
+		
+		unix_server bar_server(io_service,d.get_stream(0),
+		                stream_protocol::endpoint(bar_socket));
+		
+		unix_server screen_server(io_service,d.get_stream(1),
+		                stream_protocol::endpoint(screen_socket));
+		
+		unix_server card_server(io_service,d.get_stream(2),
+		                stream_protocol::endpoint(card_socket));
+		
+		unix_server printer_server(io_service,d.get_stream(3),
+		                stream_protocol::endpoint(printer_socket));
+		
+		tcp_server server4(io_service,d.get_stream(4),
 		                boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),1200));
 		
+		tcp_server server5(io_service,d.get_stream(5),
+		                boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),1201));
+		
 		io_service.run();
+		
+		::unlink(bar_socket);
+		::unlink(screen_socket);
+		::unlink(card_socket);
+		::unlink(printer_socket);
 	} catch (std::exception& e) {
-		std::cerr << "Exception:" << e.what() << std::endl;
+		LOG_ERROR(app,"Exception: %s",e.what());
 		return 3;
 	}
 
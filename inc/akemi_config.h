@@ -4,4 +4,10 @@
 #define AKEMI_VERSION_MAJOR 0
 #define AKEMI_VERSION_MINOR 1
 
+// most verbose logging::level_t compiled in
+#define AKEMI_LOG_LEVEL 4
+
+// inc/awaitable.h available, built as C++20
+#define AKEMI_COROUTINES 0
+
 #endif
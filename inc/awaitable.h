@@ -0,0 +1,519 @@
+#ifndef AWAITABLE_H
+#define AWAITABLE_H
+
+#include <akemi_config.h>
+
+#if AKEMI_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <deque>
+
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/signals2.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+#include <usb.h>
+#include <cp210x.h>
+#include <base_stream.h>
+#include <shared_buffer.h>
+
+// Awaitable wrappers for the callback based I/O in this library.
+//
+// A coroutine is resumed on whatever thread completes the operation it
+// waits for: the libusb event thread for transfers and cp210x, the
+// io_service for streams. Frames come from coro::frame_pool and awaiting
+// does not allocate, so a transaction costs one frame however many steps
+// it takes.
+
+namespace coro {
+
+// size-classed free lists for coroutine frames, see src/awaitable.cpp
+namespace frame_pool {
+	void* allocate(size_t size);
+	void deallocate(void *frame, size_t size);
+}
+
+/* ------------------------------------ */
+
+// shared by a transaction and whoever may abort it; a suspended awaiter
+// installs what cancel() has to do to wake it up
+class cancel_token
+{
+	struct state {
+		boost::recursive_mutex mutex;
+		bool cancelled;
+		boost::function<void ()> handler;
+
+		state() : cancelled(false) {}
+	};
+	boost::shared_ptr<state> s;
+public:
+	// an empty token never cancels
+	cancel_token() {}
+
+	static cancel_token create() {
+		cancel_token token;
+		token.s.reset(new state);
+		return token;
+	}
+
+	// the handler runs with the token locked, an awaiter that is woken
+	// up by its operation meanwhile blocks in detach() until it returns
+	void cancel() const {
+		if(!s) return;
+
+		boost::lock_guard<boost::recursive_mutex> lock(s->mutex);
+		if(s->cancelled) return;
+		s->cancelled = true;
+
+		boost::function<void ()> handler;
+		handler.swap(s->handler);
+		if(handler) handler();
+	}
+
+	bool cancelled() const {
+		if(!s) return false;
+
+		boost::lock_guard<boost::recursive_mutex> lock(s->mutex);
+		return s->cancelled;
+	}
+
+	// runs start() and, when it returns true, installs handler without a
+	// cancel() slipping in between; -1 when cancelled before starting
+	template<typename Start, typename Handler>
+	int run(Start start, Handler handler) const {
+		if(!s) return start();
+
+		boost::lock_guard<boost::recursive_mutex> lock(s->mutex);
+		if(s->cancelled) return -1;
+		if(!start()) return 0;
+		s->handler = handler;
+		return 1;
+	}
+
+	void detach() const {
+		if(!s) return;
+
+		boost::lock_guard<boost::recursive_mutex> lock(s->mutex);
+		s->handler.clear();
+	}
+};
+
+// cancels the token when it expires before being destroyed
+class timeout
+{
+	boost::asio::deadline_timer timer;
+public:
+	timeout(boost::asio::io_service &io_svc, const cancel_token &token, unsigned int ms)
+	:timer(io_svc,boost::posix_time::milliseconds(ms))
+	{
+		timer.async_wait([token](const boost::system::error_code &error) {
+			if(!error) token.cancel();
+		});
+	}
+
+	~timeout() {
+		timer.cancel();
+	}
+};
+
+/* ------------------------------------ */
+
+template<typename T = void> class task;
+
+namespace detail {
+
+struct promise_base
+{
+	std::coroutine_handle<> continuation;
+	bool detached;
+
+	promise_base() : detached(false) {}
+
+	static void* operator new(size_t size) {
+		return frame_pool::allocate(size);
+	}
+
+	static void operator delete(void *frame, size_t size) {
+		frame_pool::deallocate(frame,size);
+	}
+
+	struct final_awaiter {
+		bool await_ready() noexcept { return false; }
+
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+			promise_base &promise = h.promise();
+			if(promise.continuation) {
+				return promise.continuation;
+			}
+			if(promise.detached) {
+				h.destroy();
+			}
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	final_awaiter final_suspend() noexcept { return {}; }
+
+	// the library does not throw across callbacks, neither do tasks
+	void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct promise : promise_base
+{
+	T value;
+
+	task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+};
+
+template<>
+struct promise<void> : promise_base
+{
+	task<void> get_return_object();
+	void return_void() {}
+};
+
+} //namespace detail
+
+// lazily started coroutine, either co_await'ed by another task or detached
+template<typename T>
+class task
+{
+public:
+	typedef detail::promise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> handle_type;
+private:
+	handle_type h;
+public:
+	explicit task(handle_type _h) : h(_h) {}
+	task(task &&other) : h(std::exchange(other.h,handle_type())) {}
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	~task() {
+		if(h) h.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+		h.promise().continuation = caller;
+		return h;
+	}
+
+	T await_resume() {
+		if constexpr (!std::is_void<T>::value) {
+			return std::move(h.promise().value);
+		}
+	}
+
+	// runs the coroutine on the calling thread up to its first suspension,
+	// the frame frees itself when the coroutine finishes
+	void detach() {
+		handle_type handle = std::exchange(h,handle_type());
+		handle.promise().detached = true;
+		handle.resume();
+	}
+};
+
+namespace detail {
+
+template<typename T>
+task<T> promise<T>::get_return_object() {
+	return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() {
+	return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+} //namespace detail
+
+/* ------------------------------------ */
+
+struct io_result {
+	int status;
+	size_t length;
+};
+
+struct chunk {
+	int status;
+	shared_buffer buffer;
+};
+
+// co_await coro::submit(tr) - submits the transfer and yields its
+// libusb_transfer_status, or the negative error of a failed submit.
+// The transfer's own timeout applies, cancelling cancels the transfer.
+class submit
+{
+	usb::transfer &tr;
+	cancel_token token;
+	std::coroutine_handle<> caller;
+	int result;
+
+	struct cancel_transfer {
+		usb::transfer *tr;
+		void operator()() const { tr->cancel(); }
+	};
+
+	static void completed(usb::transfer *tr, void *arg) {
+		submit *self = (submit*)arg;
+		self->token.detach();
+		self->result = tr->status();
+		self->caller.resume();
+	}
+public:
+	submit(usb::transfer &_tr, const cancel_token &_token = cancel_token())
+	:tr(_tr)
+	,token(_token)
+	,result(LIBUSB_TRANSFER_CANCELLED)
+	{}
+
+	bool await_ready() const { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) {
+		caller = h;
+		// nothing may touch *this once run() returned 1
+		return token.run([this]() {
+			tr.set_completion_hook(completed,this);
+			result = tr.submit();
+			if(result < 0) {
+				tr.set_completion_hook(0,0);
+				return false;
+			}
+			return true;
+		},cancel_transfer{&tr}) == 1;
+	}
+
+	int await_resume() const { return result; }
+};
+
+namespace detail {
+
+// shared by the send awaiters; Target::send_async(data,len,callback)
+// has to call back exactly once whenever it returns 0
+template<typename Target>
+class send_base
+{
+protected:
+	void *data;
+	size_t len;
+	cancel_token token;
+	std::coroutine_handle<> caller;
+	io_result result;
+
+	struct completion {
+		send_base *self;
+		void operator()(int status, size_t length) const {
+			self->result.status = status;
+			self->result.length = length;
+			self->caller.resume();
+		}
+	};
+
+	send_base(void *_data, size_t _len, const cancel_token &_token)
+	:data(_data)
+	,len(_len)
+	,token(_token)
+	{
+		result.status = LIBUSB_TRANSFER_CANCELLED;
+		result.length = 0;
+	}
+public:
+	bool await_ready() const { return false; }
+
+	// a send in flight is not aborted by the token, only its timeout
+	// bounds it; cancelling keeps further sends from being started
+	bool await_suspend(std::coroutine_handle<> h) {
+		if(token.cancelled()) {
+			return false;
+		}
+
+		caller = h;
+		// the callback may already have resumed us when this returns
+		int ret = static_cast<Target*>(this)->start(completion{this});
+		if(ret < 0) {
+			result.status = ret;
+			return false;
+		}
+		return true;
+	}
+
+	io_result await_resume() const { return result; }
+};
+
+} //namespace detail
+
+// co_await coro::send(cp, data, len) - cp210x::send_async
+class send : public detail::send_base<send>
+{
+	friend class detail::send_base<send>;
+
+	cp210x *cp;
+	base_stream *stream;
+	uint32_t timeout;
+
+	template<typename Callback>
+	int start(Callback callback) {
+		if(cp) {
+			return cp->send_async(data,len,callback,timeout);
+		}
+		return stream->send(data,len,callback);
+	}
+public:
+	send(cp210x &_cp, void *data, size_t len, uint32_t _timeout = 1000,
+	     const cancel_token &token = cancel_token())
+	:detail::send_base<send>(data,len,token)
+	,cp(&_cp)
+	,stream(0)
+	,timeout(_timeout)
+	{}
+
+	// co_await coro::send(stream, data, len) - base_stream::send
+	send(base_stream &_stream, void *data, size_t len,
+	     const cancel_token &token = cancel_token())
+	:detail::send_base<send>(data,len,token)
+	,cp(0)
+	,stream(&_stream)
+	,timeout(0)
+	{}
+};
+
+/* ------------------------------------ */
+
+// queues the chunks a cp210x or base_stream delivers between awaits so
+// that none are lost while the transaction is busy elsewhere; a single
+// coroutine awaits next() at a time
+class chunk_reader
+{
+	boost::mutex mutex;
+	std::deque<chunk> chunks;
+	cp210x *cp;
+
+	std::coroutine_handle<> waiting;
+	chunk *target;
+	cancel_token current;
+
+	scoped_fanout_connection connection;
+
+	void push(int status, shared_buffer buffer) {
+		std::coroutine_handle<> h;
+		cancel_token token;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if(!waiting) {
+				chunks.push_back(chunk{status,buffer});
+				return;
+			}
+			target->status = status;
+			target->buffer = buffer;
+			h = std::exchange(waiting,std::coroutine_handle<>());
+			token = std::exchange(current,cancel_token());
+		}
+		// waits for a cancel() that is running concurrently
+		token.detach();
+		h.resume();
+	}
+
+	void cancel_wait() {
+		std::coroutine_handle<> h;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if(!waiting) return;
+			target->status = LIBUSB_TRANSFER_CANCELLED;
+			target->buffer = shared_buffer();
+			h = std::exchange(waiting,std::coroutine_handle<>());
+			current = cancel_token();
+		}
+		h.resume();
+	}
+
+	struct cancel_handler {
+		chunk_reader *reader;
+		void operator()() const { reader->cancel_wait(); }
+	};
+
+	class next_awaiter
+	{
+		chunk_reader &reader;
+		cancel_token token;
+		chunk result;
+	public:
+		next_awaiter(chunk_reader &_reader, const cancel_token &_token)
+		:reader(_reader)
+		,token(_token)
+		{
+			result.status = LIBUSB_TRANSFER_CANCELLED;
+		}
+
+		bool await_ready() const { return false; }
+
+		bool await_suspend(std::coroutine_handle<> h) {
+			chunk_reader &r = reader;
+			return token.run([this,&r,h]() {
+				boost::lock_guard<boost::mutex> lock(r.mutex);
+				if(!r.chunks.empty()) {
+					result = r.chunks.front();
+					r.chunks.pop_front();
+					return false;
+				}
+				r.waiting = h;
+				r.target = &result;
+				r.current = token;
+				if(r.cp) {
+					// fails harmlessly with auto_recv or a full ring
+					r.cp->recv_async();
+				}
+				return true;
+			},cancel_handler{&r}) == 1;
+		}
+
+		chunk await_resume() const { return result; }
+	};
+public:
+	chunk_reader(cp210x &_cp)
+	:cp(&_cp)
+	,target(0)
+	{
+		connection = _cp.buffer_received.connect(boost::bind(&chunk_reader::push,this,_1,_2));
+	}
+
+	chunk_reader(base_stream &stream)
+	:cp(0)
+	,target(0)
+	{
+		connection = stream.buffer_received.connect(boost::bind(&chunk_reader::push,this,0,_1));
+	}
+
+	// the next chunk, status LIBUSB_TRANSFER_CANCELLED and no buffer
+	// when the token got cancelled first
+	next_awaiter next(const cancel_token &token = cancel_token()) {
+		return next_awaiter(*this,token);
+	}
+
+	// chunks received and not awaited yet
+	size_t pending() {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		return chunks.size();
+	}
+};
+
+} //namespace coro
+
+#endif // AKEMI_COROUTINES
+
+#endif // AWAITABLE_H
@@ -1,21 +1,54 @@
 #ifndef BASE_STREAM_H
 #define BASE_STREAM_H
 
-#include <iostream>
 #include <boost/function.hpp>
 #include <boost/signals2.hpp>
 
+#include <shared_buffer.h>
+#include <fanout.h>
+#include <log.h>
+#include <atomic>
+
 class base_stream
 {
+	std::atomic<bool> congested_flag;
 public:
 	typedef boost::function<void (int status, size_t len)> send_callback;
 
+	base_stream() : congested_flag(false) {}
+
 	~base_stream() {
-		std::cerr << "~base_stream" << std::endl;
+		LOG_TRACE(stream,"~base_stream");
 	}
 
-	boost::signals2::signal<void (void *data, size_t len)> data_received;
+	fanout<void (void *data, size_t len)> data_received;
+	// same chunk as data_received, may be kept after the signal returns;
+	// timestamp() is the arrival time of the chunk
+	fanout<void (shared_buffer buffer)> buffer_received;
+	
+	void deliver(const shared_buffer &buffer) {
+		data_received(buffer.data(),buffer.size());
+		buffer_received(buffer);
+	}
+	
 	virtual int send(void *data, size_t len, send_callback callback) = 0;
+	
+	// streams that queue sends take new ones before earlier ones completed
+	// and report a full queue through backpressure; the others expect
+	// one send at a time
+	virtual bool queues_sends() const { return false; }
+	
+	// may be raised from any thread
+	boost::signals2::signal<void (bool congested)> backpressure;
+	
+	bool congested() const {
+		return congested_flag;
+	}
+	
+	void set_congested(bool congested) {
+		congested_flag = congested;
+		backpressure(congested);
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+// Fixed size pcapng file used as a ring of equally sized slots. Every slot
+// always holds one complete block, so the file opens in Wireshark at any
+// moment: USB transfers are Enhanced Packet Blocks with the usbmon mmapped
+// link type (220), stream chunks and unused slots are Custom Blocks.
+// Records that do not fit a slot are truncated (captured < original length).
+class capture
+{
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	size_t slot_size;
+	size_t slot_count;
+	size_t ring_offset;
+	std::atomic<uint64_t> next_slot;
+	
+	uint8_t* claim_slot();
+public:
+	enum stream_event_t {
+		serial_rx = 1,
+		serial_tx = 2,
+		socket_rx = 3,
+		socket_tx = 4
+	};
+	
+	capture(const char *path, size_t size, size_t _slot_size = 512);
+	~capture();
+	
+	// event is the usbmon record type: 'S' submit, 'C' complete, 'E' error;
+	// xfer_type and status use libusb numbering and are converted here
+	void usb(uint64_t id, char event,
+	         uint8_t xfer_type, uint8_t endpoint,
+	         uint8_t devnum, uint16_t busnum,
+	         int status, uint32_t length,
+	         const uint8_t *setup,
+	         const void *data, size_t data_len);
+	
+	void stream(stream_event_t event, uint32_t channel, const void *data, size_t len);
+	
+	operator bool() const;
+	
+	// capture configured by AKEMI_CAPTURE=<file> (and optionally
+	// AKEMI_CAPTURE_SIZE in bytes), null when disabled
+	static capture* instance();
+};
+
+#endif //CAPTURE_H
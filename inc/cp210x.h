@@ -2,11 +2,36 @@
 #define CP210X_H
 
 #include <usb.h>
+#include <shared_buffer.h>
+#include <usb_trace.h>
+#include <usb_stats.h>
 #include <boost/signals2.hpp>
 #include <boost/thread.hpp>
+#include <vector>
+#include <deque>
+#include <list>
 
 class cp210x 
 {
+public:
+	typedef boost::function<void (int status, size_t bytes_transferred)> send_callback;
+	// status is a libusb_transfer_status, or a negative libusb error
+	// when the request could not be submitted
+	typedef boost::function<void (int status)> config_callback;
+	typedef boost::function<void (int status, const uint8_t *data, size_t len)> control_callback;
+	
+	// what send_async does when every pooled send transfer is in flight
+	enum send_policy_t {
+		send_queue, // keep the request until a transfer is recycled
+		send_fail   // return LIBUSB_ERROR_BUSY immediately
+	};
+	
+	// who calls libusb_handle_events for the context
+	enum events_t {
+		events_thread,  // a dedicated io_thread owned by this cp210x
+		events_external // someone else, e.g. usb::asio_events
+	};
+private:
 	usb::context context;
 	usb::device device;
 	usb::device_handle handle;
@@ -15,13 +40,126 @@ class cp210x
 	uint16_t interface_number;
 	usb::interface iface;
 	
-	usb::transfer recv_transfer;
+	// ring of bulk IN transfers kept submitted on UART_ENDPOINT_IN;
+	// completions are delivered to data_received strictly in ring order
+	std::vector< boost::shared_ptr<usb::transfer> > recv_ring;
+	std::vector<shared_buffer> recv_buffers;
+	std::vector<bool> recv_ready;
+	buffer_pool::pointer recv_pool;
+	size_t recv_head;
+	size_t recv_tail;
+	size_t recv_pending;
+	// a resubmission failed and the ring runs short
+	bool recv_degraded;
+	boost::mutex recv_mutex;
+	
+	void init_recv_ring(size_t depth, size_t packets);
+	void recv_completed(size_t slot);
+	int submit_recv();
+	void refill_recv();
+
+	struct send_request {
+		void *buffer;
+		size_t len;
+		send_callback callback;
+		uint32_t timeout;
+		uint64_t queued_ns;
+		bool zero_packet;
+		uint64_t seq;
+	};
+	
+	// callbacks are delivered in submission order, also when a transfer
+	// times out while later ones complete
+	struct send_completion {
+		send_callback callback;
+		size_t len;
+		bool done;
+		int status;
+		size_t actual_length;
+	};
+	
+	// fixed pool of bulk OUT transfers recycled by send_async
+	std::vector< boost::shared_ptr<usb::transfer> > send_pool;
+	std::vector<uint64_t> send_seq;
+	std::vector<uint64_t> send_started;
+	std::vector<size_t> send_free;
+	std::deque<send_request> send_backlog;
+	std::deque<send_completion> send_order;
+	uint64_t send_order_base;
+	send_policy_t send_policy;
+	boost::mutex send_mutex;
+	
+	// bytes accepted by send_async and not reported back yet
+	size_t send_queued;
+	size_t send_high_water;
+	size_t send_low_water;
+	bool send_congested;
+	bool send_reported;
+	boost::recursive_mutex backpressure_mutex;
+	// send_async to callback, backlog included, ns
+	usb::histogram send_wait;
+	
+	void init_send_pool(size_t depth);
+	void send_completed(size_t slot);
+	int submit_send(size_t slot, const send_request &request);
+	int enqueue_send(send_request request, bool may_queue);
+	bool collect_sends(std::vector<send_completion> &ready);
+	bool account_send(size_t added, size_t released);
+	bool over_high_water(size_t len) const;
+	void deliver_sends(std::vector<send_completion> &ready, bool crossed);
+	
+	// small writes merged into one bulk OUT transfer by set_coalescing
+	struct write_batch {
+		std::vector<uint8_t> data;
+		std::vector< std::pair<send_callback,size_t> > parts;
+		uint64_t opened_ns;
+		uint32_t timeout;
+	};
+	typedef boost::shared_ptr<write_batch> write_batch_ptr;
+	
+	size_t send_max_packet;
+	size_t coalesce_size;
+	uint64_t coalesce_deadline_ns;
+	write_batch_ptr open_batch;
+	std::vector<write_batch_ptr> batch_free;
+	bool coalesce_stop;
+	boost::condition_variable coalesce_cond;
+	boost::thread coalesce_thread;
+	
+	int coalesce(void *buffer, size_t len, send_callback callback, uint32_t timeout);
+	void flush_batch();
+	void batch_completed(write_batch_ptr b, int status, size_t actual_length);
+	void coalesce_thread_func();
+	void stop_coalescing();
+
+	// asynchronous control transfers in flight; completed ones are parked
+	// in control_done and freed later, outside their own completion signal
+	std::list< boost::shared_ptr<usb::transfer> > control_active;
+	std::list< boost::shared_ptr<usb::transfer> > control_done;
+	boost::mutex control_mutex;
+	
+	int control_async(uint8_t bmRequestType, uint8_t bRequest,
+	                  uint16_t wValue, uint16_t wIndex,
+	                  const void *data, uint16_t wLength,
+	                  control_callback callback);
+	int set_interface_config_async(uint8_t request, const void *data, size_t len,
+	                               config_callback callback);
+	int get_interface_config_async(uint8_t request, size_t len, control_callback callback);
+	void control_completed(usb::transfer *tr, control_callback callback);
 
 	int completed;
 	boost::thread io_thread;
 	
 	void io_thread_func();
+	void start_recv();
+	void stop_transfers();
+	size_t in_flight();
+	
+	boost::shared_ptr<usb::trace_player> player;
+	bool realtime_replay;
+	void replay_thread_func();
 	
+	// guarded by recv_mutex, cleared when the transfers stop
 	bool auto_recv;
 	
 	static usb::device find_device(const usb::context &context, uint16_t vid, uint16_t pid);
@@ -33,6 +171,36 @@ class cp210x
 	int set_interface_config(uint8_t request, const void *data, size_t len);
 	int get_interface_config(uint8_t request, void *data, size_t len);
 	
+	// shadow copies of the line settings, filled by every successful get
+	// or set and answered from instead of the device
+	enum shadow_register_t {
+		shadow_baud,
+		shadow_ctl,
+		shadow_flow,
+		shadow_modem,
+		shadow_count
+	};
+	struct shadow_registers {
+		bool valid[shadow_count];
+		uint32_t baud;
+		uint16_t ctl;
+		uint32_t flow[4]; // flow_t
+		uint8_t modem;
+	} shadow;
+	boost::mutex shadow_mutex;
+	boost::signals2::scoped_connection device_left_connection;
+	
+	static int shadow_register(uint8_t request);
+	bool shadow_matches(uint8_t request, const void *data, size_t len);
+	void shadow_store(uint8_t request, const void *data, size_t len);
+	bool shadow_load(uint8_t request, void *data, size_t len);
+	void config_stored(uint8_t request, std::vector<uint8_t> value,
+	                   config_callback callback, int status);
+	void config_loaded(uint8_t request, control_callback callback,
+	                   int status, const uint8_t *data, size_t len);
+	
+	static int encode_config_string(size_t max_length, const char *data,
+	                                boost::shared_array<char> &buffer);
 	int set_config_string(uint16_t value, size_t max_length, char* data);
 public:
 	enum data_t {
@@ -59,28 +227,157 @@ public:
 		stop1_5   = 0x0001,
 		stop2     = 0x0002
 	};
+	
+	// GET_MDMSTS bits, modem_dtr and modem_rts are also the SET_MHS lines
+	enum modem_t {
+		modem_dtr = 0x01,
+		modem_rts = 0x02,
+		modem_cts = 0x10,
+		modem_dsr = 0x20,
+		modem_ri  = 0x40,
+		modem_dcd = 0x80
+	};
+	
+	enum purge_t {
+		purge_tx = 0x0001,
+		purge_rx = 0x0002
+	};
+	
+	// CP210X_SET_FLOW / CP210X_GET_FLOW payload
+	struct flow_t {
+		uint32_t control_handshake;
+		uint32_t flow_replace;
+		uint32_t xon_limit;
+		uint32_t xoff_limit;
+	} __attribute__((packed));
+	
+	// several configuration requests issued back to back
+	// with a single completion, see cp210x::submit
+	class batch
+	{
+		friend class cp210x;
+		
+		struct request {
+			uint8_t code;
+			std::vector<uint8_t> data;
+		};
+		std::vector<request> requests;
+		
+		batch& add(uint8_t code, const void *data, size_t len);
+	public:
+		batch& baud(uint32_t baud);
+		batch& ctl(uint16_t ctl);
+		batch& flow(const flow_t &flow);
+		batch& purge(uint16_t queues);
+		
+		size_t size() const;
+	};
 		
 public:
-	cp210x(const usb::context &ctx, bool auto_recv = false);
+	// recv_depth - number of bulk IN transfers submitted concurrently
+	// recv_packets - size of every IN transfer in wMaxPacketSize units,
+	//                transfers larger than one packet end on a short packet
+	// send_depth - number of preallocated bulk OUT transfers
+	// events - events_external leaves libusb event handling to the caller
+	cp210x(const usb::context &ctx, bool auto_recv = false,
+	       size_t recv_depth = 4, size_t recv_packets = 1,
+	       size_t send_depth = 8, events_t events = events_thread);
+	// opens the given adapter instead of the first one found
+	cp210x(const usb::context &ctx, const usb::device &dev, bool auto_recv = false,
+	       size_t recv_depth = 4, size_t recv_packets = 1,
+	       size_t send_depth = 8, events_t events = events_thread);
 	~cp210x();
+	
+	// every attached adapter with the cp210x vendor and product id
+	static std::vector<usb::device> find_devices(const usb::context &context);
+	// dev has the cp210x vendor and product id
+	static bool is_adapter(const usb::device &dev);
 
 	uint32_t get_baud();
 	int set_baud(uint32_t baud);
 	
 	uint16_t get_ctl();
 	int set_ctl(uint16_t ctl);
+	
+	flow_t get_flow();
+	int set_flow(const flow_t &flow);
+	
+	// answered from the shadow copy unless refresh is set, the input
+	// lines (cts, dsr, ri, dcd) are only as fresh as the last refresh
+	uint8_t get_modem_status(bool refresh = false);
+	// drives the lines in mask (modem_dtr, modem_rts) to their value in lines
+	int set_modem_control(uint8_t lines, uint8_t mask);
+	
+	// Line settings are cached: gets are answered from the last value read
+	// or written and sets that would not change anything are skipped,
+	// also by the async variants and batches. The cache starts empty and is
+	// dropped by reset(), invalidate_shadow() and when the device leaves.
+	void invalidate_shadow();
+	// disables and re-enables the UART interface
+	int reset();
+	
+	// non-blocking variants built on usb::transfer::fill_control,
+	// callbacks run on the libusb event thread
+	int get_baud_async(boost::function<void (int status, uint32_t baud)> callback);
+	int set_baud_async(uint32_t baud, config_callback callback);
+	
+	int get_ctl_async(boost::function<void (int status, uint16_t ctl)> callback);
+	int set_ctl_async(uint16_t ctl, config_callback callback);
+	
+	int set_flow_async(const flow_t &flow, config_callback callback);
+	int purge_async(uint16_t queues, config_callback callback);
+	
+	// runs the requests in order and reports once: the status of the
+	// first failing request or LIBUSB_TRANSFER_COMPLETED
+	int submit(const batch &b, config_callback callback);
+private:
+	void batch_step(boost::shared_ptr<batch> b, size_t index,
+	                config_callback callback, int status);
+public:
 
-	boost::signals2::signal<void (int status, void *data, size_t len)> data_received;
+	fanout<void (int status, void *data, size_t len)> data_received;
+	// same chunk as data_received, may be kept after the signal returns;
+	// timestamp() is the arrival time of the chunk
+	fanout<void (int status, shared_buffer buffer)> buffer_received;
 	
 	int recv_async();
 	int send_async(void *buffer, size_t len, 
-	               boost::function<void (int status, size_t bytes_transferred)> callback,
+	               send_callback callback,
 	               uint32_t timeout = 1000);
 	
+	void set_send_policy(send_policy_t policy);
+	
+	// send_backpressure(true) once the bytes accepted and not completed
+	// reach high_water, (false) when they are back down to low_water.
+	// With send_fail, sends beyond high_water return LIBUSB_ERROR_BUSY.
+	// At most send_depth transfers are in flight. high_water 0 disables.
+	void set_queue_limits(size_t high_water, size_t low_water);
+	bool send_queue_congested();
+	boost::signals2::signal<void (bool congested)> send_backpressure;
+	
+	// merges sends of up to max_size bytes into bulk OUT transfers of up
+	// to max_size, rounded down to wMaxPacketSize; a merged transfer is
+	// submitted when full or deadline_us after its first write, whichever
+	// comes first. Every callback still gets its own byte count. Merged
+	// sends are copied and queue regardless of the send policy.
+	// max_size 0 turns coalescing off.
+	int set_coalescing(size_t max_size, uint32_t deadline_us = 200);
+	
+	usb::histogram_snapshot send_wait_snapshot() const;
+	// send wait percentiles in the cp210x log category
+	void log_stats() const;
+	
 	int send(void *buffer, size_t len, uint32_t timeout = 1000);
 	int recv(void *buffer, size_t len, uint32_t timeout = 1000);
 		
+	// feeds bulk IN completions from a USB_TRACE recording into
+	// data_received at recorded pace (or as fast as possible) instead of
+	// talking to an adapter; sends complete immediately. Fails when a
+	// device has been opened.
+	int replay(const char *path, bool realtime = true);
+		
 	int set_product_string(char *s);
+	int set_product_string_async(const char *s, config_callback callback);
 	int get_product_string(char *s, size_t len);
 	
 	operator bool() const;	
@@ -0,0 +1,89 @@
+#ifndef CP210X_MANAGER_H
+#define CP210X_MANAGER_H
+
+#include <usb.h>
+#include <cp210x.h>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/signals2.hpp>
+
+// Opens any number of cp210x adapters on one usb::context and handles
+// libusb events for all of them on a single thread instead of one
+// io_thread per adapter.
+class cp210x_manager
+{
+public:
+	typedef boost::shared_ptr<cp210x> pointer;
+	
+	struct adapter {
+		pointer cp;
+		std::string path;   // usb::device::port_path
+		std::string serial; // empty when the adapter has none
+		usb::device dev;    // tells a replugged adapter apart
+	};
+private:
+	usb::context context;
+	std::vector<adapter> adapters;
+	boost::mutex mutex;
+	
+	bool auto_recv;
+	size_t recv_depth;
+	size_t recv_packets;
+	size_t send_depth;
+	
+	int completed;
+	int event_cpu;
+	boost::thread event_thread;
+	
+	// set by the hotplug slots, which must not open devices themselves,
+	// and acted on by the event thread
+	struct hotplug_state {
+		std::atomic<bool> arrived;
+		std::atomic<bool> left;
+		hotplug_state() : arrived(false), left(false) {}
+	};
+	boost::shared_ptr<hotplug_state> hotplug;
+	std::string watch_spec;
+	boost::signals2::scoped_connection arrived_connection;
+	boost::signals2::scoped_connection left_connection;
+	
+	void event_thread_func();
+	void hotplug_changed();
+	pointer open(const usb::device &dev, const std::string &path, const std::string &serial);
+	bool is_open(const std::string &path);
+public:
+	// event_cpu - pins the event thread to that cpu, -1 leaves it floating.
+	// libusb lets a single thread handle the events of a context at a time,
+	// so more threads on one context would only take turns.
+	cp210x_manager(const usb::context &ctx, bool auto_recv = true,
+	               size_t recv_depth = 4, size_t recv_packets = 1,
+	               size_t send_depth = 8, int event_cpu = -1);
+	~cp210x_manager();
+	
+	// every attached adapter not opened yet; returns the number opened
+	size_t open_all();
+	// the adapter with that iSerialNumber or at that port path ("1-1.4"),
+	// null when there is none
+	pointer open_serial(const std::string &serial);
+	pointer open_path(const std::string &path);
+	// comma separated "serial:<serial>", "path:<port path>" or "all"
+	size_t open_spec(const std::string &spec);
+	// opens the adapters of spec now and whenever one is plugged in, and
+	// forgets those unplugged; needs a context with hotplug enabled
+	size_t watch(const std::string &spec);
+	
+	// raised on the event thread for adapters opened or forgotten by watch
+	boost::signals2::signal<void (adapter a)> adapter_opened;
+	boost::signals2::signal<void (adapter a)> adapter_closed;
+	
+	size_t size();
+	adapter get(size_t i);
+	pointer find_serial(const std::string &serial);
+	pointer find_path(const std::string &path);
+};
+
+#endif //CP210X_MANAGER_H
@@ -14,6 +14,8 @@ public:
 	~cp210x_stream();
 	
 	virtual int send(void *data, size_t len, base_stream::send_callback callback);
+	// the sender is cp210x::send_async
+	virtual bool queues_sends() const { return true; }
 private:
 	sender_t sender;
 };
@@ -2,29 +2,49 @@
 #define DISPATCHER_H
 
 #include <cp210x.h>
+#include <usb_asio.h>
 #include <base_stream.h>
+#include <dmx_stream.h>
 
 #include <vector>
 #include <boost/asio.hpp>
 #include <boost/signals2.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 
 class dispatcher
 {
 	usb::context context;
 	cp210x cp;
+	boost::scoped_ptr<usb::asio_events> events;
+	// channel framing, raw streams when null
+	boost::scoped_ptr<dmx_mux> mux;
 	
-	boost::signals2::connection connection;
+	fanout_connection connection;
+	boost::signals2::connection backpressure_connection;
 	
 	std::vector< boost::shared_ptr<base_stream> > streams;
 	
-	void dispatch(int status, void *data, size_t len);
+	void dispatch(int status, shared_buffer buffer);
 public:
-	dispatcher(usb::context &_context,boost::asio::io_service &io_svc);
+	// replay_path - USB_TRACE recording to play back instead of an adapter
+	// asio - handle libusb events on io_svc instead of a cp210x thread
+	// framed - addr/len channel frames as in serial_dmx; otherwise every
+	//          stream writes raw bytes and stream 0 gets everything read
+	dispatcher(usb::context &_context,boost::asio::io_service &io_svc,
+	           const char *replay_path = 0, bool realtime = true,
+	           bool asio = true, bool framed = false);
 	~dispatcher();
 
 	boost::shared_ptr<base_stream> get_stream(size_t i);	
 	
+	// see cp210x::set_coalescing
+	int set_coalescing(size_t max_size, uint32_t deadline_us);
+	
+	// usb transfer and cp210x send latency, frame parser counters
+	// at info level
+	void log_stats() const;
+	
 	operator bool() const;
 };
 
@@ -0,0 +1,83 @@
+#ifndef DMX_COMPRESS_H
+#define DMX_COMPRESS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// LZ77 style compression of channel payloads against a history of the
+// last DMX_HISTORY bytes sent on the channel, kept across frames on both
+// ends. The first payload byte tells how the rest is coded:
+//
+//   DMX_CODEC_RAW  the bytes as they are
+//   DMX_CODEC_LZ   a sequence of tokens
+//                  0LLLLLLL          L + 1 literal bytes follow
+//                  1LLLLLDD DDDDDDDD L + 3 bytes copied from D + 1 back
+//
+// with DMX_CODEC_RESET or'ed in when the history was emptied before the
+// payload. Both ends add every decoded byte to the history, raw frames
+// included, so frames must arrive complete and in order (see dmx_link).
+// Whenever that may not hold, e.g. a send failed, the encoder is reset;
+// a decoder that failed or was told frames got lost discards payloads
+// until the next one with DMX_CODEC_RESET.
+
+#define DMX_HISTORY   1024
+#define DMX_HASH_BITS 12
+
+#define DMX_CODEC_RAW   0x00
+#define DMX_CODEC_LZ    0x01
+#define DMX_CODEC_RESET 0x80
+
+#define DMX_MATCH_MIN 3
+#define DMX_MATCH_MAX (DMX_MATCH_MIN + 31)
+
+struct dmx_compress_stats {
+	uint64_t plain; // bytes before coding / after decoding
+	uint64_t coded; // payload bytes on the wire, codec byte included
+	uint64_t errors; // payloads that failed to decode
+};
+
+class dmx_encoder
+{
+	uint8_t history[DMX_HISTORY];
+	// last position + 1 of each 3 byte prefix hash, 0 when unused
+	uint32_t head[1 << DMX_HASH_BITS];
+	uint32_t pos;
+	// the next payload carries DMX_CODEC_RESET
+	bool restart;
+
+	// adds data[i] to the history, data[i..i+2] to the hash when available
+	void absorb(const uint8_t *data, size_t len, size_t i);
+public:
+	dmx_encoder();
+
+	// codes a prefix of data into out, at most capacity bytes including
+	// the codec byte; consumed is set to the length of that prefix. Picks
+	// whichever of DMX_CODEC_LZ and DMX_CODEC_RAW carries more of data,
+	// or fewer bytes for the same amount. Returns the bytes written.
+	size_t encode(const uint8_t *data, size_t len, uint8_t *out, size_t capacity, size_t &consumed);
+
+	// empties the history, also that of the decoder with the next payload
+	void reset();
+};
+
+class dmx_decoder
+{
+	uint8_t history[DMX_HISTORY];
+	uint32_t pos;
+	// payloads are discarded until one with DMX_CODEC_RESET
+	bool lost;
+
+	int fail();
+public:
+	dmx_decoder();
+
+	// returns the decoded length, -1 for a malformed payload, one that
+	// does not fit in capacity or one discarded while the history is
+	// lost; the history only takes what decoded successfully
+	int decode(const uint8_t *in, size_t len, uint8_t *out, size_t capacity);
+
+	// payloads before the next one were lost
+	void lose();
+};
+
+#endif //DMX_COMPRESS_H
@@ -0,0 +1,242 @@
+#ifndef DMX_LINK_H
+#define DMX_LINK_H
+
+#include <base_stream.h>
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+// Optional reliable link layer under the addr/len channel frames,
+// enabled with DMX_LINK and negotiated with the peer at startup.
+//
+// Every frame becomes addr, len, seq, data[len], crc16 (CRC-16/CCITT,
+// little endian, over everything before it). Address 0 carries control
+// frames of a type and three argument bytes: HELLO/HELLO_ACK with the
+// version and the sender's 16 bit epoch, ACK, NAK, SKIP and SKIP_ACK
+// naming a channel address and sequence number.
+//
+// The receiver delivers frames in order and acknowledges each one as it
+// is delivered; frames arriving ahead of a gap are held, unacknowledged,
+// and the missing one is NAKed. Frames outside the receive window are
+// dropped without an answer. The retransmission timeout of a frame
+// starts when the lower layer finished writing it, no copy is queued
+// again while one is still waiting there, and the timeout grows with
+// the time the peer's answers may queue at the line rate. After
+// DMX_LINK_RETRIES attempts the sender fails every frame in flight on
+// the channel and SKIPs the receiver past them; a peer that does not
+// acknowledge the SKIP either makes the link negotiate again.
+//
+// A HELLO with a new epoch means the peer started over, both ends then
+// restart their numbering and fail what was in flight; repeated HELLOs
+// of the same epoch are only answered. When the peer does not answer
+// the first negotiation the link falls back to plain frames; such a
+// peer sees the HELLO frames as noise and may pass a few stray bytes on
+// to its channels.
+
+#define DMX_LINK_VERSION     2
+#define DMX_LINK_MAX_WINDOW  64
+#define DMX_LINK_MAX_PAYLOAD 62
+#define DMX_LINK_OVERHEAD    5
+// the part of the retransmission timeout not spent queueing on the line
+#define DMX_LINK_RTO_MS      100
+#define DMX_LINK_RETRIES     5
+
+struct dmx_link_stats {
+	uint64_t bad_headers;  // bytes skipped where a frame header was expected
+	uint64_t crc_errors;   // frames dropped for a bad checksum
+	uint64_t retransmits;  // frames sent again, on NAK or timeout
+	uint64_t failed;       // frames given up after DMX_LINK_RETRIES
+	uint64_t naks_sent;
+	uint64_t duplicates;   // frames received again after being acknowledged
+	uint64_t out_of_window; // frames dropped with a sequence number outside the window
+	uint64_t skips;        // times the peer skipped frames it gave up on
+};
+
+class dmx_link
+:public boost::enable_shared_from_this<dmx_link>
+{
+public:
+	// channel is 0-based, the control channel is one past the last one
+	typedef boost::function<int (size_t channel, void *data, size_t len,
+	                             base_stream::send_callback callback)> sender_t;
+	// addr is the 1-based channel address
+	typedef boost::function<void (uint8_t addr, const shared_buffer &payload)> deliver_t;
+	// addr 0: the link restarted, whatever was in flight either way is
+	// lost, called from any thread. Otherwise frames the peer sent on addr
+	// before what is delivered next were skipped, called in order with
+	// deliver.
+	typedef boost::function<void (uint8_t addr)> lost_t;
+
+	enum state_t {
+		state_negotiating,
+		state_active,
+		state_plain
+	};
+
+	// must be owned by a boost::shared_ptr before negotiate is called
+	dmx_link(boost::asio::io_service &io_svc, sender_t _lower, deliver_t _deliver, lost_t _lost,
+	         size_t _channels);
+	~dmx_link();
+
+	// sends HELLO until the peer answers or gives up to plain frames;
+	// sends made meanwhile are held back. Starts the timers.
+	void negotiate();
+
+	state_t state() const;
+
+	// bytes per second of the line and the largest write the lower layer
+	// makes, used for the retransmission timeout; 0 when unknown
+	void set_line_rate(size_t bytes_per_second, size_t write_bytes);
+
+	// sends on channel fail unless the link is active
+	void require(size_t channel);
+
+	// frame is a plain addr/len frame as built by dmx_stream; the callback
+	// runs once the peer acknowledged it
+	int send(size_t channel, void *frame, size_t len, base_stream::send_callback callback);
+
+	// link framed bytes from the peer, in order from one thread
+	void dispatch(const shared_buffer &buffer);
+
+	dmx_link_stats stats() const;
+
+	static uint16_t crc16(const uint8_t *data, size_t len);
+private:
+	struct tx_entry {
+		bool used;
+		uint8_t seq;
+		shared_buffer frame;
+		size_t payload;
+		base_stream::send_callback callback;
+		// a copy is waiting in the lower layer, sent_ns is when the last
+		// one was written
+		bool queued;
+		uint64_t sent_ns;
+		// tells the write completions of retransmissions apart
+		uint32_t attempt;
+		unsigned retries;
+	};
+
+	struct tx_channel {
+		uint8_t next_seq;
+		tx_entry window[DMX_LINK_MAX_WINDOW];
+		// a SKIP to skip_to is not acknowledged yet
+		bool skipping;
+		uint8_t skip_to;
+		uint64_t skip_ns;
+		unsigned skip_retries;
+		// sends fail unless the link is active
+		bool required;
+	};
+
+	struct rx_channel {
+		uint8_t expected;
+		bool nak_sent;
+		shared_buffer held[DMX_LINK_MAX_WINDOW];
+	};
+
+	struct held_send {
+		size_t channel;
+		void *frame;
+		size_t len;
+		base_stream::send_callback callback;
+	};
+
+	// a send callback and its status
+	typedef std::pair<base_stream::send_callback,int> completion;
+
+	struct pending_write {
+		size_t channel;
+		shared_buffer frame;
+		uint8_t seq;
+		uint32_t attempt; // 0 for control frames
+	};
+
+	// a delivered payload, or the frames skipped before the next one
+	struct arrival {
+		uint8_t addr;
+		bool lost;
+		shared_buffer payload;
+	};
+
+	sender_t lower;
+	deliver_t deliver;
+	lost_t lost;
+	size_t channels;
+
+	// only touched with mutex held, ticking once negotiate started it
+	boost::asio::deadline_timer ticker;
+	bool ticking;
+	buffer_pool::pointer frame_pool;
+
+	mutable boost::mutex mutex;
+	state_t current;
+	unsigned hellos;
+	uint64_t hello_ns;
+	// the link has been active, it does not fall back to plain any more
+	bool was_active;
+	uint16_t local_epoch;
+	uint16_t peer_epoch; // 0 until the peer said hello
+	size_t line_rate;
+	size_t write_bytes;
+	// tx entries in use, over all channels
+	size_t unacked;
+	uint32_t attempts;
+	std::deque<held_send> held;
+	std::vector<tx_channel> tx;
+	std::vector<rx_channel> rx;
+
+	// link framed bytes of a frame split across chunks
+	std::vector<uint8_t> carry;
+	buffer_pool::pointer payload_pool;
+	
+	// collected with mutex held, run by whoever releases it; arrivals
+	// are only collected by dispatch
+	bool restarted;
+	std::vector<pending_write> writes;
+	std::vector<arrival> arrivals;
+	std::vector<completion> completed;
+	std::deque<held_send> released;
+
+	std::atomic<uint64_t> bad_headers;
+	std::atomic<uint64_t> crc_errors;
+	std::atomic<uint64_t> retransmits;
+	std::atomic<uint64_t> failed;
+	std::atomic<uint64_t> naks_sent;
+	std::atomic<uint64_t> duplicates;
+	std::atomic<uint64_t> out_of_window;
+	std::atomic<uint64_t> skips;
+
+	// must be called with mutex held
+	void start_tick();
+	void tick(const boost::system::error_code &error);
+	void written(size_t channel, uint8_t seq, uint32_t attempt, int status);
+
+	// must be called with mutex held
+	void send_control(uint8_t type, uint8_t arg1, uint8_t arg2, uint8_t arg3);
+	void send_hello(uint8_t type);
+	void send_skip(size_t channel);
+	void transmit(size_t channel, tx_entry &e);
+	void give_up(size_t channel);
+	void start_negotiation();
+	void reset();
+	void resolve(state_t state);
+	uint64_t timeout_ns() const;
+	size_t parse(const uint8_t *d, size_t len, const shared_buffer *owner, uint64_t stamp);
+	void frame_received(uint8_t addr, uint8_t seq, const shared_buffer &payload);
+	void deliver_held(uint8_t addr);
+	void skip_received(uint8_t addr, uint8_t to);
+	void control_received(const uint8_t *payload, size_t len);
+	
+	// releases lock and runs what was collected while it was held
+	void run_collected(boost::unique_lock<boost::mutex> &lock);
+};
+
+#endif //DMX_LINK_H
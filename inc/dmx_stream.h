@@ -0,0 +1,189 @@
+#ifndef DMX_STREAM_H
+#define DMX_STREAM_H
+
+#include <base_stream.h>
+#include <dmx_link.h>
+#include <dmx_compress.h>
+
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Channel framing shared by serial_dmx (kernel tty) and dispatcher
+// (cp210x bulk transfers): every frame is a one byte channel address
+// (1-based), a one byte payload length and up to 62 payload bytes.
+// Frames are padded to 64 bytes on the wire unless DMX_VARIABLE_FRAMES
+// is set, then they are sent as exactly len + 2 bytes.
+//
+// A send is cut into frames copied out of a per-stream pool right away,
+// up to window frames are handed to the sender at a time and the send
+// completes when its last frame did. More than a window of frames
+// waiting raises backpressure until they have all gone out.
+//
+// Channels listed in DMX_COMPRESS (comma separated addresses) carry
+// payloads coded by dmx_encoder, the peer must be configured alike. They
+// need the link layer (DMX_LINK) to be active and fail sends otherwise.
+// When a frame fails the coding history starts over, frames coded against
+// the old one fail as well.
+
+class dmx_stream
+:public base_stream,
+ public boost::enable_shared_from_this<dmx_stream>
+{
+public:
+	typedef boost::function<int (void *data, size_t len, send_callback callback)> sender_t;
+
+	// variable - send len + 2 bytes instead of the whole buffer
+	// window - frames in flight at the sender at a time
+	// compress - code payloads with dmx_encoder
+	dmx_stream(sender_t _sender, uint32_t _index, bool _variable = false, size_t _window = 4,
+	           bool _compress = false);
+	~dmx_stream();
+	
+	struct buffer_t {
+		uint8_t addr;
+		uint8_t len;
+		uint8_t data[62];	
+	};
+	
+	virtual int send(void *data, size_t len, base_stream::send_callback callback);
+	virtual bool queues_sends() const { return true; }
+	
+	// bytes given to send and payload bytes framed for them
+	dmx_compress_stats sent_stats() const;
+	
+	// the peer lost the coding history, frames not sent yet fail
+	void restart();
+private:
+	// one send call, completed when frames reaches 0
+	struct send_op {
+		base_stream::send_callback callback;
+		size_t frames;
+		int status;
+		size_t len;
+	};
+	
+	struct out_frame {
+		shared_buffer frame;
+		size_t payload; // bytes of the send carried
+		boost::shared_ptr<send_op> op;
+		unsigned generation; // of the coding history
+	};
+	
+	sender_t sender;
+	uint8_t addr;
+	bool variable;
+	size_t window;
+	
+	buffer_pool::pointer frame_pool;
+	boost::scoped_ptr<dmx_encoder> encoder;
+	
+	std::atomic<uint64_t> plain_bytes;
+	std::atomic<uint64_t> coded_bytes;
+	
+	boost::mutex mutex;
+	std::deque<out_frame> pending;
+	size_t in_flight;
+	// counts encoder resets
+	unsigned generation;
+	
+	void pump();
+	void frame_done(const out_frame &f, int status);
+	// must be called with mutex held, collects the sends that completed
+	void restart_history(std::vector< boost::shared_ptr<send_op> > &done);
+};
+
+/* ------------------------------------ */
+
+struct dmx_parse_stats {
+	uint64_t frames;      // delivered
+	uint64_t bytes;       // payload delivered
+	uint64_t reassembled; // frames that spanned more than one chunk
+	uint64_t bad_addr;    // bytes skipped where a channel address was expected
+	uint64_t bad_len;     // headers dropped for a length over the maximum
+};
+
+// a dmx_stream per channel over one sender, and the demultiplexer
+// for frames coming back
+class dmx_mux
+{
+	// per compressed channel, fed in order by the link layer
+	struct decompressor {
+		dmx_decoder decoder;
+		std::atomic<uint64_t> plain;
+		std::atomic<uint64_t> coded;
+		std::atomic<uint64_t> errors;
+		
+		decompressor() : plain(0), coded(0), errors(0) {}
+	};
+	
+	std::vector< boost::shared_ptr<dmx_stream> > streams;
+	// indexed by the address byte, null for addresses without a channel
+	base_stream *table[256];
+	
+	// parser state carried over between chunks
+	size_t header_have;
+	uint8_t frame_addr;
+	uint8_t frame_len;
+	size_t payload_have;
+	// without DMX_VARIABLE_FRAMES every frame fills a whole buffer_t,
+	// padding is the rest of the current one still to be skipped
+	bool fixed_frames;
+	size_t padding;
+	buffer_pool::pointer reassembly_pool;
+	shared_buffer reassembly;
+	
+	std::atomic<uint64_t> frames;
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> reassembled;
+	std::atomic<uint64_t> bad_addr;
+	std::atomic<uint64_t> bad_len;
+	
+	// DMX_LINK set, between the streams and the sender
+	boost::shared_ptr<dmx_link> link;
+	// the link restarted, decompressors lose their history
+	std::atomic<bool> restarted;
+	
+	// indexed by address, null for uncompressed channels
+	std::vector< boost::shared_ptr<decompressor> > decompressors;
+	buffer_pool::pointer decode_pool;
+	
+	// linked - the frame came through an active link layer
+	void frame_done(const shared_buffer &payload, bool linked);
+	// starts skipping the padding of the frame just parsed
+	void frame_padding();
+	void link_deliver(uint8_t addr, const shared_buffer &payload);
+	void link_lost(uint8_t addr);
+public:
+	// channel is 0-based, with a link layer control frames go to
+	// the extra channel one past the last one
+	typedef dmx_link::sender_t sender_t;
+
+	// io_svc - runs link layer timers, no link layer without one
+	dmx_mux(sender_t sender, size_t channels, boost::asio::io_service *io_svc = 0);
+	
+	// delivers the payload of every frame in buffer to its stream; frames
+	// may be split across calls, the padding of fixed size frames is
+	// skipped as a whole, other bytes that cannot start a frame are
+	// skipped until a valid header shows up again. Chunks must be passed
+	// in order from one thread.
+	void dispatch(const shared_buffer &buffer);
+	
+	// see dmx_link::set_line_rate
+	void set_line_rate(size_t bytes_per_second, size_t write_bytes);
+	
+	// may be called from any thread
+	dmx_parse_stats stats() const;
+	void log_stats() const;
+	
+	size_t size() const;
+	boost::shared_ptr<base_stream> get_stream(size_t i);
+};
+
+#endif //DMX_STREAM_H
@@ -0,0 +1,256 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <atomic>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/locks.hpp>
+
+// Subscriber list for the data path, used where a boost::signals2::signal
+// would be emitted for every chunk.
+//
+// Emission is wait-free: it bumps the reader count of the current epoch,
+// walks an immutable snapshot of the slots and drops the count again.
+// connect/disconnect are rare, take a mutex, publish a new snapshot and
+// retire the old one. Reclaiming flips the epoch once the readers of the
+// one before have drained, so that new emissions count on the other side,
+// and frees what was retired before that; it runs on every write and after
+// emissions while something is left, so snapshots do not pile up under
+// continuous emission. A slot disconnected while an emission is running
+// (also from within its own call) is not called again by that emission.
+// The fanout must outlive its emissions, connections may outlive it.
+
+class fanout_connection;
+
+namespace detail {
+
+class fanout_base
+{
+protected:
+	struct slot_base {
+		std::atomic<bool> connected;
+
+		slot_base() : connected(true) {}
+		virtual ~slot_base() {}
+	};
+	typedef boost::shared_ptr<slot_base> slot_ptr;
+
+	struct snapshot {
+		std::vector<slot_ptr> slots;
+	};
+
+	// shared with the connections so that they can tell whether the
+	// fanout is still there
+	struct state {
+		std::atomic<snapshot*> current;
+		std::atomic<unsigned> epoch;
+		// emissions in progress, by the parity of the epoch they started in
+		std::atomic<int> readers[2];
+		boost::mutex mutex;
+		// snapshots and the epoch they were retired in
+		std::vector< std::pair<snapshot*,unsigned> > retired;
+		// retired is not empty, read by emitters without the mutex
+		std::atomic<bool> reclaimable;
+
+		state() : current(new snapshot), epoch(0), reclaimable(false) {
+			readers[0] = 0;
+			readers[1] = 0;
+		}
+
+		~state() {
+			delete current.load();
+			for(auto &r : retired) delete r.first;
+		}
+
+		unsigned enter() {
+			const unsigned e = epoch.load();
+			readers[e & 1].fetch_add(1);
+			return e;
+		}
+
+		void leave(unsigned e) {
+			readers[e & 1].fetch_sub(1);
+		}
+
+		// must be called with mutex held
+		void publish(snapshot *next) {
+			retired.push_back(std::make_pair(current.exchange(next),epoch.load()));
+			reclaimable = true;
+			reclaim();
+		}
+
+		// must be called with mutex held. An emission on a retired snapshot
+		// entered before it was retired, counted under any epoch up to the
+		// retiring one. Those of the other parity than e had left when the
+		// flip to e checked them, those of the parity of e - 1 have left
+		// when that count reads 0 now: everything retired before e is free.
+		void reclaim() {
+			const unsigned e = epoch.load();
+			if(readers[(e + 1) & 1].load() != 0) return;
+
+			size_t kept = 0;
+			for(auto &r : retired) {
+				if(r.second != e) {
+					delete r.first;
+				} else {
+					retired[kept++] = r;
+				}
+			}
+			retired.resize(kept);
+			reclaimable = kept != 0;
+
+			// what was retired in e is freed after the next flip
+			if(kept) epoch = e + 1;
+		}
+
+		// called at the end of every emission; skipped while a writer
+		// holds the mutex, which reclaims by itself
+		void reclaim_after_emit() {
+			if(!reclaimable.load(std::memory_order_relaxed)) return;
+			boost::unique_lock<boost::mutex> lock(mutex,boost::try_to_lock);
+			if(lock.owns_lock()) reclaim();
+		}
+
+		void add(const slot_ptr &slot) {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			snapshot *next = new snapshot(*current.load());
+			next->slots.push_back(slot);
+			publish(next);
+		}
+
+		void remove(slot_base *slot) {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			slot->connected = false;
+
+			snapshot *next = new snapshot;
+			for(auto &s : current.load()->slots) {
+				if(s.get() != slot) next->slots.push_back(s);
+			}
+			publish(next);
+		}
+
+		void clear() {
+			boost::lock_guard<boost::mutex> lock(mutex);
+			for(auto &s : current.load()->slots) {
+				s->connected = false;
+			}
+			publish(new snapshot);
+		}
+	};
+
+	boost::shared_ptr<state> s;
+
+	fanout_base() : s(new state) {}
+
+	fanout_connection attach(const slot_ptr &slot) const;
+public:
+	void disconnect_all_slots() {
+		s->clear();
+	}
+
+	bool empty() const {
+		const unsigned e = s->enter();
+		bool result = s->current.load()->slots.empty();
+		s->leave(e);
+		return result;
+	}
+
+	friend class ::fanout_connection;
+};
+
+} //namespace detail
+
+class fanout_connection
+{
+	friend class detail::fanout_base;
+
+	boost::weak_ptr<detail::fanout_base::state> owner;
+	boost::weak_ptr<detail::fanout_base::slot_base> slot;
+public:
+	void disconnect() {
+		boost::shared_ptr<detail::fanout_base::state> s = owner.lock();
+		boost::shared_ptr<detail::fanout_base::slot_base> sl = slot.lock();
+		if(s && sl) {
+			s->remove(sl.get());
+		}
+		owner.reset();
+		slot.reset();
+	}
+
+	bool connected() const {
+		boost::shared_ptr<detail::fanout_base::slot_base> sl = slot.lock();
+		return sl && sl->connected;
+	}
+};
+
+// disconnects when destroyed or reassigned
+class scoped_fanout_connection : public fanout_connection
+{
+public:
+	scoped_fanout_connection() {}
+	scoped_fanout_connection(const fanout_connection &c) : fanout_connection(c) {}
+
+	scoped_fanout_connection& operator=(const fanout_connection &c) {
+		disconnect();
+		fanout_connection::operator=(c);
+		return *this;
+	}
+
+	~scoped_fanout_connection() {
+		disconnect();
+	}
+private:
+	scoped_fanout_connection(const scoped_fanout_connection&);
+	scoped_fanout_connection& operator=(const scoped_fanout_connection&);
+};
+
+inline fanout_connection detail::fanout_base::attach(const slot_ptr &slot) const {
+	s->add(slot);
+
+	fanout_connection c;
+	c.owner = s;
+	c.slot = slot;
+	return c;
+}
+
+/* ------------------------------------ */
+
+template<typename Signature> class fanout;
+
+template<typename... Args>
+class fanout<void (Args...)> : public detail::fanout_base
+{
+	typedef boost::function<void (Args...)> function_type;
+
+	struct slot : slot_base {
+		function_type fn;
+
+		slot(const function_type &_fn) : fn(_fn) {}
+	};
+public:
+	template<typename F>
+	fanout_connection connect(F f) {
+		return attach(slot_ptr(new slot(function_type(f))));
+	}
+
+	void operator()(Args... args) const {
+		state *st = s.get();
+		const unsigned e = st->enter();
+
+		snapshot *current = st->current.load();
+		for(auto &sl : current->slots) {
+			if(sl->connected.load(std::memory_order_relaxed)) {
+				static_cast<slot*>(sl.get())->fn(args...);
+			}
+		}
+
+		st->leave(e);
+		st->reclaim_after_emit();
+	}
+};
+
+#endif //FANOUT_H
@@ -0,0 +1,64 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <akemi_config.h>
+#include <atomic>
+#include <cstdarg>
+
+namespace logging {
+
+enum level_t {
+	error   = 0,
+	warning = 1,
+	info    = 2,
+	debug   = 3,
+	trace   = 4
+};
+
+enum category_t {
+	usb,
+	cp210x,
+	stream,
+	dmx,
+	app,
+	category_count
+};
+
+// runtime threshold per category, messages above it are skipped
+// before any argument is evaluated
+extern std::atomic<int> thresholds[category_count];
+
+inline bool enabled(category_t category, level_t level) {
+	return level <= thresholds[category].load(std::memory_order_relaxed);
+}
+
+void set_level(category_t category, level_t level);
+
+// formats into a slot of a lock-free ring drained by a background thread;
+// when the ring is full info and below are dropped (and counted)
+void write(category_t category, level_t level, const char *format, ...)
+	__attribute__((format(printf,3,4)));
+
+// waits until everything queued so far has been written out
+void flush();
+
+} //namespace logging
+
+// AKEMI_LOG_LEVEL (akemi_config.h) removes more verbose statements at
+// compile time, the runtime threshold is checked before formatting
+#define AKEMI_LOG(category,level,...) \
+	do { \
+		if((level) <= AKEMI_LOG_LEVEL && logging::enabled(logging::category,(level))) \
+			logging::write(logging::category,(level),__VA_ARGS__); \
+	} while(0)
+
+#define LOG_ERROR(category,...)   AKEMI_LOG(category,logging::error,__VA_ARGS__)
+#define LOG_WARNING(category,...) AKEMI_LOG(category,logging::warning,__VA_ARGS__)
+#define LOG_INFO(category,...)    AKEMI_LOG(category,logging::info,__VA_ARGS__)
+#define LOG_DEBUG(category,...)   AKEMI_LOG(category,logging::debug,__VA_ARGS__)
+#define LOG_TRACE(category,...)   AKEMI_LOG(category,logging::trace,__VA_ARGS__)
+
+#define LOG_ENABLED(category,level) \
+	((level) <= AKEMI_LOG_LEVEL && logging::enabled(logging::category,(level)))
+
+#endif //LOG_H
@@ -2,47 +2,109 @@
 #define SERIAL_DMX_H
 
 #include <base_stream.h>
+#include <dmx_stream.h>
 
+#include <deque>
 #include <vector>
+#include <cstdint>
 #include <boost/asio.hpp>
-#include <boost/signals2.hpp>
 #include <boost/shared_ptr.hpp>
 #include <serial_stream.h>
 
-class dmx_stream : public base_stream
+// Transmit scheduler for channels sharing one link. Channels with a
+// higher priority always go first, channels of equal priority share the
+// link by deficit round robin in proportion to their weight. Writes are
+// paced by a token bucket at the line rate so that frames wait here,
+// where the order can still change, rather than in the tty buffer.
+// One write is outstanding on the link at a time; frames queued while
+// it runs are packed, in scheduling order, into the next one. Not
+// thread safe, runs on the io_service of the link.
+class dmx_scheduler
 {
+	struct frame {
+		void *data;
+		size_t len;
+		base_stream::send_callback callback;
+	};
+	
+	struct packed_frame {
+		size_t index;
+		frame f;
+	};
+	
+	struct channel {
+		std::deque<frame> queue;
+		int priority;
+		uint32_t weight;
+		size_t deficit;
+		
+		channel();
+	};
+	
+	dmx_stream::sender_t link;
+	boost::asio::deadline_timer pacer;
+	
+	std::vector<channel> channels;
+	size_t cursor;
+	// quantum already added for the current visit of cursor
+	bool granted;
+	bool busy;
+	bool pacing;
+	
+	// the write on the link and the frames it carries
+	size_t pack_limit;
+	std::vector<uint8_t> pack;
+	std::vector<packed_frame> packed;
+	
+	// token bucket, bytes
+	uint32_t rate;
+	size_t burst;
+	double tokens;
+	uint64_t refilled_ns;
+	
+	int select();
+	void refill();
+	void pump();
+	void completed(int status);
 public:
-	typedef boost::function<int (void *data, size_t len, send_callback callback)> sender_t;
-
-	dmx_stream(sender_t _sender, uint32_t _index);
-	~dmx_stream();
-	
-	struct buffer_t {
-		uint8_t addr;
-		uint8_t len;
-		uint8_t data[62];	
-	} buffer;
-	
-	virtual int send(void *data, size_t len, base_stream::send_callback callback);
-private:
-	sender_t sender;
+	dmx_scheduler(boost::asio::io_service &io_svc, dmx_stream::sender_t _link, size_t count);
+	~dmx_scheduler();
+	
+	// bytes per second, 0 disables pacing; burst is the most the link
+	// may be ahead of the line rate, at least a link layer frame
+	void set_rate(uint32_t bytes_per_second, size_t burst_bytes);
+	// largest write frames are packed into, a single frame may exceed it
+	void set_pack_limit(size_t bytes);
+	size_t get_pack_limit() const;
+	// priority - higher is served first
+	// weight - share of the link relative to channels of equal priority
+	void set_channel(size_t index, int priority, uint32_t weight);
+	
+	int send(size_t index, void *data, size_t len, base_stream::send_callback callback);
 };
 
+/* ------------------------------------ */
+
 class serial_dmx
 {
-	boost::signals2::connection connection;
+	fanout_connection connection;
 	serial_stream serial;
 	
-	std::vector< boost::shared_ptr<base_stream> > streams;
-	
-	void dispatch(void *data, size_t len);
+	dmx_scheduler scheduler;
+	dmx_mux mux;
 public:
 	serial_dmx(boost::asio::io_service &io_svc);
 	~serial_dmx();
 
 	boost::shared_ptr<base_stream> get_stream(size_t i);	
 	
+	// see dmx_scheduler::set_channel
+	void set_channel(size_t i, int priority, uint32_t weight);
+	
+	// frame parser counters at info level
+	void log_stats() const;
+	
 	operator bool() const;
 };
 
-#endif //SERIAL_DMX_H
\ No newline at end of file
+#endif //SERIAL_DMX_H
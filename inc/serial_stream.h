@@ -14,9 +14,12 @@ class serial_stream : public base_stream
 
 	std::string path;
 	std::string opts;
+	int baud;
+	int parity;
 	bool open_serial();
 
-	uint8_t read_buf[256];
+	buffer_pool::pointer read_pool;
+	shared_buffer read_buf;
 
 	void setup_reviver();
 	void reviver_callback(const boost::system::error_code &error);
@@ -30,6 +33,10 @@ public:
 		const char *_path, const char *_opts = "{ \"parity\": 2, \"baud\": 38400 }");
 	
 	virtual int send(void *data, size_t len, base_stream::send_callback callback);
+	
+	// bytes per second the line carries at the configured baud rate,
+	// one start and one stop bit
+	uint32_t byte_rate() const;
 };
 
 #endif
\ No newline at end of file
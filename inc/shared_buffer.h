@@ -0,0 +1,89 @@
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <atomic>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+class buffer_pool;
+
+/* ------------------------------------ */
+
+// fixed size block handed out by buffer_pool, returns to the pool
+// when the last shared_buffer referencing it goes away
+struct buffer_block
+{
+	std::atomic<int> refs;
+	boost::weak_ptr<buffer_pool> pool;
+	size_t capacity;
+	uint8_t *data;
+	
+	buffer_block(boost::weak_ptr<buffer_pool> _pool, size_t _capacity);
+	~buffer_block();
+};
+
+void intrusive_ptr_add_ref(buffer_block *block);
+void intrusive_ptr_release(buffer_block *block);
+
+/* ------------------------------------ */
+
+// reference counted view into a buffer_block; copies and slices
+// share the underlying memory and the receive timestamp
+class shared_buffer
+{
+	boost::intrusive_ptr<buffer_block> block;
+	uint8_t *ptr;
+	size_t len;
+	uint64_t stamp;
+public:
+	shared_buffer();
+	shared_buffer(boost::intrusive_ptr<buffer_block> _block, size_t _len);
+	
+	uint8_t* data() const;
+	size_t size() const;
+	size_t capacity() const;
+	
+	shared_buffer slice(size_t offset, size_t length) const;
+	shared_buffer slice(size_t offset) const;
+	
+	// CLOCK_MONOTONIC ns at which the bytes arrived, 0 if unknown
+	uint64_t timestamp() const;
+	void set_timestamp(uint64_t ns);
+	
+	operator bool() const;
+};
+
+/* ------------------------------------ */
+
+class buffer_pool : public boost::enable_shared_from_this<buffer_pool>
+{
+	friend void intrusive_ptr_release(buffer_block *block);
+	
+	size_t block_size;
+	boost::mutex mutex;
+	std::vector<buffer_block*> free_blocks;
+	
+	buffer_pool(size_t _block_size);
+	
+	void recycle(buffer_block *block);
+public:
+	typedef boost::shared_ptr<buffer_pool> pointer;
+	
+	static pointer create(size_t block_size, size_t prealloc = 0);
+	~buffer_pool();
+	
+	// returns a buffer of block_size bytes, allocating a new block
+	// only when every pooled one is still referenced
+	shared_buffer acquire();
+	
+	size_t get_block_size() const;
+};
+
+#endif //SHARED_BUFFER_H
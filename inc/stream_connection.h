@@ -3,10 +3,12 @@
 
 #include <base_stream.h>
 #include <usb.h>
+#include <capture.h>
 
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/signals2.hpp>
 #include <boost/asio.hpp>
+#include <boost/array.hpp>
 #include <stdlib.h>
 #include <cstdint>
 
@@ -14,29 +16,54 @@ template<class Protocol>
 class stream_connection 
 :public boost::enable_shared_from_this< stream_connection<Protocol> >
 {
-	bool debug;
 	bool async_write;
-	uint8_t read_buf[256];
+	// every chunk sent to the client is preceded by a frame header
+	bool framed;
+	buffer_pool::pointer header_pool;
+	// reads stay alive until the stream is done sending them
+	buffer_pool::pointer read_pool;
+	// stopped reading until the stream's send queue drains
+	bool paused;
 	
+	boost::asio::io_service &io;
 	typename Protocol::socket socket;
 	typename Protocol::endpoint endpoint;
 	
-	boost::signals2::connection connection;	
+	fanout_connection connection;	
+	boost::signals2::connection backpressure_connection;
 
 	stream_connection(boost::asio::io_service& io_service)
-	:debug(getenv("DEBUG_STREAM_CONNECTION") != 0),
-	 async_write(getenv("STREAM_CONNECTION_ASYNC_WRITE") != 0),
+	:async_write(getenv("STREAM_CONNECTION_ASYNC_WRITE") != 0),
+	 framed(getenv("STREAM_CONNECTION_FRAMED") != 0),
+	 header_pool(buffer_pool::create(FRAME_HEADER_SIZE,4)),
+	 read_pool(buffer_pool::create(256,4)),
+	 paused(false),
+	 io(io_service),
 	 socket(io_service) {
 		
 	}
 	
+	// little endian CLOCK_MONOTONIC arrival time in ns, then payload length
+	static const size_t FRAME_HEADER_SIZE = 12;
+	
+	shared_buffer frame_header(const shared_buffer &buffer) {
+		shared_buffer header = header_pool->acquire();
+		uint8_t *p = header.data();
+		const uint64_t stamp = buffer.timestamp();
+		const uint32_t len = buffer.size();
+		for(size_t i = 0; i < 8; i++) p[i] = stamp >> (i * 8);
+		for(size_t i = 0; i < 4; i++) p[8 + i] = len >> (i * 8);
+		return header;
+	}
+	
 public:
 	boost::signals2::signal<void ()> disconnected;
 
 	typedef boost::shared_ptr< stream_connection<Protocol> > pointer;
 
 	~stream_connection() {
-		std::cerr << "~stream_connection" << std::endl;
+		LOG_DEBUG(stream,"~stream_connection");
+		backpressure_connection.disconnect();
 		disconnected();
 	}
 
@@ -52,9 +79,19 @@ public:
 		return endpoint;  
 	}  
 
+	// streams that queue sends get every read right away and hold the
+	// socket off through backpressure, the others get one send at a time
 	void net_to_device(boost::shared_ptr<base_stream> stream) {
+		const bool pipelined = stream->queues_sends();
+		if(pipelined && stream->congested()) {
+			LOG_DEBUG(stream,"send queue congested, pausing reads");
+			paused = true;
+			return;
+		}
+		
 		pointer shared = this->shared_from_this();
-		boost::asio::async_read(socket,boost::asio::buffer(read_buf),
+		shared_buffer buffer = read_pool->acquire();
+		boost::asio::async_read(socket,boost::asio::buffer(buffer.data(),buffer.size()),
 			//check callback
 			[](const boost::system::error_code &error,
 			   size_t bytes_transferred) {
@@ -63,21 +100,29 @@ public:
 			//read callback
 			[=](const boost::system::error_code &error,
 				size_t bytes_transferred) {
-				if(shared->debug) {
-					auto bytes = usb::format_bytes(shared->read_buf,bytes_transferred);
-					std::cerr << "recv[C][" << bytes_transferred << "] " 
-					          << bytes.get() << " | " << error.message() << std::endl;
-					
-				}
+				LOG_DEBUG(stream,"recv[C][%zu] %s | %s",bytes_transferred,
+				          usb::format_bytes(buffer.data(),bytes_transferred).get(),
+				          error.message().c_str());
 				 
 				if(!error) {
-					stream->send(read_buf,bytes_transferred,[=](int status, size_t len) {
-						if(shared->debug) {
-							std::cerr << "sent[S][" << len << "][" 
-							          << status << "]" << std::endl;
+					if(capture *cap = capture::instance()) {
+						cap->stream(capture::socket_rx,shared->socket.native_handle(),
+						            buffer.data(),bytes_transferred);
+					}
+					
+					int ret = stream->send(buffer.data(),bytes_transferred,
+					                       [shared,stream,buffer,pipelined](int status, size_t len) {
+						LOG_DEBUG(stream,"sent[S][%zu][%i]",len,status);
+						if(!pipelined) {
+							shared->net_to_device(stream);
 						}
-						shared->net_to_device(stream);					
-					});					
+					});
+					if(ret < 0) {
+						LOG_WARNING(stream,"send to stream failed: %i",ret);
+					}
+					if(pipelined || ret < 0) {
+						shared->net_to_device(stream);
+					}
 				} else {
 					shared->connection.disconnect();
 					shared->disconnected();
@@ -90,40 +135,63 @@ public:
 		net_to_device(stream);
 		
 		pointer shared = this->shared_from_this();		
-		auto receiver = [shared](void *data, size_t len) {
-			if(shared->debug) {
-				auto bytes = usb::format_bytes(data,len);
-				std::cerr << "recv[S][" << len << "] " << bytes.get() << std::endl;
+		
+		if(stream->queues_sends()) {
+			boost::weak_ptr< stream_connection<Protocol> > weak(shared);
+			boost::weak_ptr<base_stream> weak_stream(stream);
+			boost::asio::io_service *svc = &io;
+			backpressure_connection = stream->backpressure.connect([svc,weak,weak_stream](bool congested) {
+				if(congested) return;
+				// raised from the usb side, reads are resumed on the io_service
+				svc->post([weak,weak_stream]() {
+					pointer shared = weak.lock();
+					boost::shared_ptr<base_stream> stream = weak_stream.lock();
+					if(shared && stream && shared->paused) {
+						LOG_DEBUG(stream,"send queue drained, resuming reads");
+						shared->paused = false;
+						shared->net_to_device(stream);
+					}
+				});
+			});
+		}
+
+		auto receiver = [shared](shared_buffer buffer) {
+			LOG_DEBUG(stream,"recv[S][%zu] %s",buffer.size(),
+			          usb::format_bytes(buffer.data(),buffer.size()).get());
+
+			if(capture *cap = capture::instance()) {
+				cap->stream(capture::socket_tx,shared->socket.native_handle(),
+				            buffer.data(),buffer.size());
 			}
 
+			// header is left empty when not framed
+			shared_buffer header;
+			if(shared->framed) {
+				header = shared->frame_header(buffer);
+			}
+			const boost::array<boost::asio::const_buffer,2> buffers = {{
+				boost::asio::buffer(header.data(),header.size()),
+				boost::asio::buffer(buffer.data(),buffer.size())
+			}};
+
 			if(shared->async_write) {
-				uint8_t *tmp = new uint8_t[len];
-				uint8_t *i = tmp;
-				std::copy((uint8_t*)data, (uint8_t*)data+len, i);
-			
-				boost::asio::async_write(shared->socket,boost::asio::buffer(tmp,len/*data,len*/),
-				[shared,tmp](const boost::system::error_code &error,
+				// the lambda keeps the pooled chunks alive until the write completes
+				boost::asio::async_write(shared->socket,buffers,
+				[shared,header,buffer](const boost::system::error_code &error,
 				    size_t bytes_transferred) {
 					
-					if(shared->debug) {
-						std::cerr << "sent[C][" << bytes_transferred << "] "
-						          << error.message() << std::endl;
-					}
+					LOG_DEBUG(stream,"sent[C][%zu] %s",bytes_transferred,
+					          error.message().c_str());
 					
 					if(error) {
 						shared->connection.disconnect();
 					}
-					
-					delete[] tmp;
 				});
 			} else {
 				boost::system::error_code error;
-				boost::asio::write(shared->socket,boost::asio::buffer(data,len),error);
+				boost::asio::write(shared->socket,buffers,error);
 			
-				if(shared->debug) {
-					std::cerr << "sent[C][" << len << "] "
-						      << error.message() << std::endl;			
-				}
+				LOG_DEBUG(stream,"sent[C][%zu] %s",header.size() + buffer.size(),error.message().c_str());
 			
 				if(error) {
 					shared->connection.disconnect();			
@@ -131,7 +199,7 @@ public:
 			}
 		};
 		
-		connection = stream->data_received.connect(receiver);
+		connection = stream->buffer_received.connect(receiver);
 	}
 };
 
@@ -4,6 +4,7 @@
 #include <stream_connection.h>
 #include <boost/shared_array.hpp>
 #include <boost/asio.hpp>
+#include <sstream>
 
 template<class Protocol>
 class stream_server 
@@ -20,10 +21,12 @@ class stream_server
 		 
 		acceptor.async_accept(c->get_socket(),c->get_endpoint(),
 		 [=,this](const boost::system::error_code &error) {
-			std::cerr << "stream_server accept_handler: "
-			          << error.message()
-			          << " | endpoint: " 
-			          << c->get_endpoint() << std::endl;
+			if(LOG_ENABLED(stream,logging::info)) {
+				std::ostringstream endpoint;
+				endpoint << c->get_endpoint();
+				LOG_INFO(stream,"stream_server accept_handler: %s | endpoint: %s",
+				         error.message().c_str(),endpoint.str().c_str());
+			}
 			
 			if(!error) {
 				c->start(this->stream);
@@ -6,6 +6,11 @@
 #include <boost/shared_array.hpp>
 #include <boost/function.hpp>
 #include <boost/signals2.hpp>
+#include <fanout.h>
+#include <boost/thread/mutex.hpp>
+#include <string>
+#include <vector>
+#include <map>
 
 namespace usb {
 
@@ -15,14 +20,23 @@ boost::shared_array<char> format_bytes(const void *data, size_t len);
 
 const char* error_name(int error_code);
 
+class device_registry;
+
 class context
 {
 	boost::shared_ptr<libusb_context> ctx;
+	boost::shared_ptr<device_registry> hotplug;
 public:
-	context(int debug_level);
+	context(int debug_level, bool hotplug = false);
 	
 	int handle_events_timeout(struct timeval *tv);
 	
+	// starts tracking devices through libusb hotplug notifications,
+	// false when the platform does not support them
+	bool enable_hotplug();
+	// live device registry, null unless hotplug is enabled
+	device_registry* registry() const;
+	
 	operator libusb_context*() const;
 	operator bool() const;
 };
@@ -50,6 +64,8 @@ public:
 
 	libusb_config_descriptor* operator->() const;
 	
+	int max_packet_size(uint8_t endpoint) const;
+	
 	operator bool() const;
 };
 
@@ -66,12 +82,72 @@ public:
 	~device();	
 
 	device_descriptor descriptor() const;
+	
+	// "<bus>-<port>.<port>..." as in sysfs, e.g. "1-1.4"
+	std::string port_path() const;
+	// opens the device to read its iSerialNumber string
+	std::string read_serial() const;
+	
 	operator libusb_device*() const;
 	operator bool() const;
 };
 
 /* ------------------------------------ */
 
+class device_registry
+{
+	struct entry {
+		entry(libusb_device *_dev);
+		
+		usb::device dev;
+		uint16_t vid;
+		uint16_t pid;
+		std::string path;
+		std::string serial;
+		bool serial_read;
+	};
+	typedef boost::shared_ptr<entry> entry_ptr;
+	
+	boost::shared_ptr<libusb_context> ctx;
+	libusb_hotplug_callback_handle callback_handle;
+	int ret;
+	
+	mutable boost::mutex mutex;
+	std::map<libusb_device*,entry_ptr> by_device;
+	std::multimap<uint32_t,entry_ptr> by_id;
+	std::map<std::string,entry_ptr> by_path;
+	std::map<std::string,entry_ptr> by_serial;
+	
+	static int hotplug_callback(libusb_context *ctx,
+	                            libusb_device *dev,
+	                            libusb_hotplug_event event,
+	                            void *user_data);
+	
+	void arrived(libusb_device *dev);
+	void left(libusb_device *dev);
+public:
+	device_registry(boost::shared_ptr<libusb_context> _ctx);
+	~device_registry();
+	
+	std::vector<device> find(uint16_t vid, uint16_t pid) const;
+	device find_path(const std::string &path) const;
+	// serials are read lazily, devices are not opened from the hotplug callback
+	device find_serial(const std::string &serial);
+	size_t count() const;
+	
+	// raised from the libusb hotplug callback, on the thread handling
+	// events or, for devices attached before, from the constructor, with
+	// the context locked by libusb. Slots must not open or close devices,
+	// handle events or block; they note the change and act on it later
+	// from another thread (see cp210x_manager::watch).
+	boost::signals2::signal<void (device dev)> device_arrived;
+	boost::signals2::signal<void (device dev)> device_left;
+	
+	operator bool() const;
+};
+
+/* ------------------------------------ */
+
 class device_handle
 {
 	boost::shared_ptr<libusb_device_handle> handle;
@@ -144,11 +220,27 @@ class device_list
 {
 	ssize_t count;
 	libusb_device **list;
+	
+	// descriptors and port paths are read once, indexes point into list
+	std::vector<device_descriptor> descriptors;
+	std::multimap<uint32_t,size_t> by_id;
+	std::map<std::string,size_t> by_path;
+	std::map<std::string,size_t> by_serial;
+	bool serials_read;
+	
+	void build_index();
+	void read_serials();
 public:
 	device_list(const context &ctx);
 	~device_list();
 
 	device find(uint16_t vid, uint16_t pid);
+	std::vector<device> find_all(uint16_t vid, uint16_t pid);
+	device find_path(const std::string &path);
+	// the first lookup opens every device with a serial string,
+	// several at a time
+	device find_serial(const std::string &serial);
+	
 	ssize_t get_count() const;
 };
 
@@ -163,6 +255,14 @@ class transfer
 	device_handle dev;
 	boost::shared_ptr<libusb_transfer> tr;
 	boost::shared_array<uint8_t> data_buffer;
+	
+	void (*completion_hook)(transfer *tr, void *arg);
+	void *completion_arg;
+	
+	// CLOCK_MONOTONIC of the last submit, for usb::transfer_stats
+	uint64_t submit_ns;
+	// CLOCK_MONOTONIC of the last completion, taken on entry to the callback
+	uint64_t complete_ns;
 
 public:
 	transfer(device_handle _dev,
@@ -180,21 +280,30 @@ public:
 	
 	/* ------------------------------ */
 	
-	boost::signals2::signal<void (transfer *tr)> transfer_completed;
+	fanout<void (transfer *tr)> transfer_completed;
+	
+	// one-shot hook run after transfer_completed for the next completion
+	// only; lets awaiters wait without connecting a slot per submit
+	void set_completion_hook(void (*hook)(transfer *tr, void *arg), void *arg);
 	
 	/* ------------------------------ */	
 	
+	// data may be null for device-to-host requests
 	void fill_control(uint8_t bmRequestType,
 	                  uint8_t bRequest,
 				      uint16_t wValue,
 				      uint16_t wIndex,
 				      const void *data,
                       uint16_t wLength);
+	// payload following the setup packet of a control transfer
+	uint8_t* control_data() const;
 	
 	/* ------------------------------ */
 	
 	boost::shared_array<uint8_t> buffer();
+	uint8_t* data() const;
 	void set_buffer(boost::shared_array<uint8_t> buffer,size_t len);	
+	// borrowed buffer, must outlive the transfer; buffer() stays empty
 	void set_buffer(void *buffer, size_t len);
 	void allocate_buffer(size_t len);
 	
@@ -216,6 +325,9 @@ public:
 	int length() const;
 	int actual_length() const;	
 	
+	// CLOCK_MONOTONIC ns at which libusb reported the last completion
+	uint64_t completed_at() const;
+	
 	/* ------------------------------ */
 	
 	operator bool() const;
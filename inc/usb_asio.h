@@ -0,0 +1,49 @@
+#ifndef USB_ASIO_H
+#define USB_ASIO_H
+
+#include <usb.h>
+
+#include <map>
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace usb {
+
+// Drives libusb event handling from a boost::asio reactor: libusb pollfds
+// are watched through posix::stream_descriptors (following the add/remove
+// notifiers) and the next libusb timeout is armed on a deadline_timer.
+// All transfer completions then run on the io_service thread. Nothing else
+// may handle events on the same context while this object exists.
+class asio_events
+{
+	struct watch {
+		watch(boost::asio::io_service &io, int fd, short _events);
+		
+		boost::asio::posix::stream_descriptor descriptor;
+		short events;
+		bool alive;
+	};
+	typedef boost::shared_ptr<watch> watch_ptr;
+	
+	context ctx;
+	boost::asio::io_service &io;
+	boost::asio::deadline_timer timer;
+	std::map<int,watch_ptr> watches;
+	boost::shared_ptr<bool> alive;
+	
+	static void pollfd_added(int fd, short events, void *user_data);
+	static void pollfd_removed(int fd, void *user_data);
+	
+	void add(int fd, short events);
+	void remove(int fd);
+	void arm(watch_ptr w, short events);
+	void arm_timer();
+	void handle_events();
+public:
+	asio_events(const context &_ctx, boost::asio::io_service &_io);
+	~asio_events();
+};
+
+} //namespace usb
+
+#endif //USB_ASIO_H
@@ -0,0 +1,108 @@
+#ifndef USB_STATS_H
+#define USB_STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+namespace usb {
+
+/* ------------------------------------ */
+
+// Log-linear latency histogram: values below 2^HISTOGRAM_SUB_BITS get a
+// bucket each, every power of two above is split in 2^HISTOGRAM_SUB_BITS
+// buckets, so a reported value is within 1/16 of the recorded one.
+// record() is wait-free and may be called from any thread.
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS  ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct histogram_snapshot {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	std::vector<uint64_t> buckets;
+
+	histogram_snapshot();
+
+	// upper bound of the bucket holding the q-th quantile, q in [0,1]
+	uint64_t percentile(double q) const;
+	uint64_t mean() const;
+
+	void merge(const histogram_snapshot &other);
+};
+
+class histogram
+{
+	std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> max;
+public:
+	histogram();
+
+	void record(uint64_t value);
+	histogram_snapshot snapshot() const;
+
+	static size_t bucket_index(uint64_t value);
+	static uint64_t bucket_upper_bound(size_t index);
+};
+
+/* ------------------------------------ */
+
+// indexed by libusb_transfer_status, stat_submit_failed counts submits
+// refused by libusb
+enum transfer_stat_t {
+	stat_completed     = 0,
+	stat_error         = 1,
+	stat_timed_out     = 2,
+	stat_cancelled     = 3,
+	stat_stall         = 4,
+	stat_no_device     = 5,
+	stat_overflow      = 6,
+	stat_submit_failed = 7,
+	stat_count
+};
+
+struct endpoint_stats_snapshot {
+	uint8_t type;     // LIBUSB_TRANSFER_TYPE_*
+	uint8_t endpoint;
+	uint64_t counters[stat_count];
+	histogram_snapshot latency; // submit to completion, ns, completed only
+};
+
+// submit-to-completion latency and outcome of every usb::transfer,
+// split by transfer type and endpoint address
+class transfer_stats
+{
+	struct endpoint_stats {
+		histogram latency;
+		std::atomic<uint64_t> counters[stat_count];
+
+		endpoint_stats();
+	};
+
+	// allocated on first use and never freed
+	std::atomic<endpoint_stats*> endpoints[4][32];
+
+	endpoint_stats* get(uint8_t type, uint8_t endpoint);
+public:
+	transfer_stats();
+
+	void completed(uint8_t type, uint8_t endpoint, int status, uint64_t latency_ns);
+	void submit_failed(uint8_t type, uint8_t endpoint);
+
+	// endpoints that saw at least one transfer
+	std::vector<endpoint_stats_snapshot> snapshot() const;
+
+	// one info line per endpoint in the usb log category
+	void log() const;
+
+	static transfer_stats& instance();
+};
+
+const char* transfer_type_name(uint8_t type);
+
+} //namespace usb
+
+#endif //USB_STATS_H
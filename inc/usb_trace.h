@@ -0,0 +1,85 @@
+#ifndef USB_TRACE_H
+#define USB_TRACE_H
+
+#include <stdio.h>
+#include <cstdint>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+namespace usb {
+
+/* ------------------------------------ */
+
+// Binary trace file layout: trace_file_header followed by trace_records,
+// each immediately followed by record.payload_length bytes of payload.
+// OUT payloads are logged on submit, IN payloads on completion.
+
+struct trace_file_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t reserved;
+} __attribute__((packed));
+
+enum trace_event_t {
+	trace_submit   = 1, // usb::transfer::submit
+	trace_complete = 2, // usb::transfer completion callback
+	// single records of synchronous transfers in older traces, these are
+	// now recorded as a submit and a completion like the others
+	trace_control  = 3, // device_handle::control_transfer
+	trace_bulk     = 4  // device_handle::bulk_transfer
+};
+
+struct trace_record {
+	uint64_t timestamp;      // CLOCK_MONOTONIC, nanoseconds
+	uint64_t id;             // pairs submits with their completions
+	uint8_t event;           // trace_event_t
+	uint8_t type;            // LIBUSB_TRANSFER_TYPE_*
+	uint8_t endpoint;
+	uint8_t reserved;
+	int32_t status;          // transfer status or libusb return code
+	int32_t length;          // requested length
+	int32_t actual_length;
+	uint32_t payload_length;
+} __attribute__((packed));
+
+uint64_t monotonic_ns();
+
+/* ------------------------------------ */
+
+class trace_recorder
+{
+	FILE *file;
+	boost::mutex mutex;
+public:
+	trace_recorder(const char *path);
+	~trace_recorder();
+	
+	void record(trace_event_t event, uint64_t id,
+	            uint8_t type, uint8_t endpoint,
+	            int status, int length, int actual_length,
+	            const void *payload, size_t payload_length);
+	
+	operator bool() const;
+	
+	// recorder opened from the USB_TRACE environment variable,
+	// null when recording is disabled
+	static trace_recorder* instance();
+};
+
+/* ------------------------------------ */
+
+class trace_player
+{
+	FILE *file;
+public:
+	trace_player(const char *path);
+	~trace_player();
+	
+	bool next(trace_record &record, std::vector<uint8_t> &payload);
+	
+	operator bool() const;
+};
+
+} //namespace usb
+
+#endif //USB_TRACE_H
@@ -6,6 +6,7 @@
 
 #include <stream_server.h>
 #include <serial_dmx.h>
+#include <log.h>
 
 int main() {
 	typedef stream_server<boost::asio::ip::tcp> tcp_server;
@@ -30,7 +31,7 @@ int main() {
 	boost::asio::signal_set signals(io_service, SIGINT, SIGQUIT);
 	signals.async_wait([&](const boost::system::error_code &error, int s) {
 		if(!error) {
-			std::cerr << "signal: " << s << std::endl;
+			LOG_INFO(app,"signal: %i",s);
 			
 			io_service.stop();
 		}
@@ -38,6 +39,36 @@ int main() {
 
 	try {
 		serial_dmx d(io_service);
+		
+		// MADOKA_PRIORITY and MADOKA_WEIGHT are comma separated lists in
+		// channel order (bar, screen, card, printer, tcp 1304, tcp 1305);
+		// missing entries keep priority 0 and weight 1
+		const char *priorities = getenv("MADOKA_PRIORITY");
+		const char *weights = getenv("MADOKA_WEIGHT");
+		for(size_t i = 0; i < 6 && (priorities || weights); i++) {
+			char *end;
+			int priority = 0;
+			uint32_t weight = 1;
+			if(priorities && *priorities) {
+				priority = strtol(priorities,&end,0);
+				priorities = *end ? end + 1 : end;
+			}
+			if(weights && *weights) {
+				weight = strtoul(weights,&end,0);
+				weights = *end ? end + 1 : end;
+			}
+			d.set_channel(i,priority,weight);
+		}
+		
+		// kill -USR1 logs frame parser counters
+		boost::asio::signal_set stats_signal(io_service,SIGUSR1);
+		boost::function<void (const boost::system::error_code&, int)> on_stats_signal;
+		on_stats_signal = [&](const boost::system::error_code &error, int) {
+			if(error) return;
+			d.log_stats();
+			stats_signal.async_wait(on_stats_signal);
+		};
+		stats_signal.async_wait(on_stats_signal);
 	
 	/*    auto serial1 = boost::make_shared<serial_stream>(io_service,"/dev/ttyUSB0");
 	
@@ -70,7 +101,7 @@ int main() {
 		::unlink(card_socket);
 		::unlink(printer_socket);
 	} catch (std::exception& e) {
-		std::cerr << "Exception:" << e.what() << std::endl;
+		LOG_ERROR(app,"Exception: %s",e.what());
 		return 3;
 	}
 
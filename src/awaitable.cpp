@@ -0,0 +1,68 @@
+#include <awaitable.h>
+
+#if AKEMI_COROUTINES
+
+#include <new>
+
+namespace coro {
+namespace frame_pool {
+
+// frames are rounded up to GRANULARITY, the ones up to
+// GRANULARITY * SIZE_CLASSES are kept on a free list per size once
+// released and never given back to the heap
+#define GRANULARITY  128
+#define SIZE_CLASSES 32
+
+struct free_frame {
+	free_frame *next;
+};
+
+struct size_class {
+	boost::mutex mutex;
+	free_frame *head;
+	
+	size_class() : head(0) {}
+};
+
+static size_class classes[SIZE_CLASSES];
+
+static size_t class_index(size_t size) {
+	return (std::max<size_t>(size,1) + GRANULARITY - 1) / GRANULARITY - 1;
+}
+
+void* allocate(size_t size) {
+	const size_t index = class_index(size);
+	if(index >= SIZE_CLASSES) {
+		return ::operator new(size);
+	}
+	
+	size_class &c = classes[index];
+	{
+		boost::lock_guard<boost::mutex> lock(c.mutex);
+		if(free_frame *frame = c.head) {
+			c.head = frame->next;
+			return frame;
+		}
+	}
+	
+	return ::operator new((index + 1) * GRANULARITY);
+}
+
+void deallocate(void *frame, size_t size) {
+	const size_t index = class_index(size);
+	if(index >= SIZE_CLASSES) {
+		::operator delete(frame);
+		return;
+	}
+	
+	size_class &c = classes[index];
+	boost::lock_guard<boost::mutex> lock(c.mutex);
+	free_frame *f = (free_frame*)frame;
+	f->next = c.head;
+	c.head = f;
+}
+
+} //namespace frame_pool
+} //namespace coro
+
+#endif // AKEMI_COROUTINES
@@ -0,0 +1,275 @@
+#include <capture.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+// pcapng block types and constants
+#define PCAPNG_SHB              0x0A0D0D0A
+#define PCAPNG_IDB              0x00000001
+#define PCAPNG_EPB              0x00000006
+#define PCAPNG_CB               0x00000BAD
+#define PCAPNG_BOM              0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT     0
+#define PCAPNG_OPT_CUSTOM_BIN   2989
+
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+
+// IANA PEN reserved for documentation (RFC 5612), tags our custom blocks
+#define CAPTURE_PEN             32473
+
+#define CUSTOM_EMPTY            0
+#define CUSTOM_STREAM           1
+
+namespace {
+
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+} __attribute__((packed));
+
+struct stream_record {
+	uint32_t pen;
+	uint32_t kind;
+	uint64_t timestamp;   // CLOCK_REALTIME, nanoseconds
+	uint32_t event;
+	uint32_t channel;
+	uint32_t length;
+	uint32_t len_cap;
+} __attribute__((packed));
+
+inline size_t pad4(size_t len) {
+	return (len + 3) & ~(size_t)3;
+}
+
+inline void put32(uint8_t *p, uint32_t v) {
+	memcpy(p,&v,sizeof(v));
+}
+
+inline void put16(uint8_t *p, uint16_t v) {
+	memcpy(p,&v,sizeof(v));
+}
+
+// libusb LIBUSB_TRANSFER_TYPE_* to usbmon numbering
+const uint8_t usbmon_xfer_type[4] = { 2, 0, 3, 1 };
+
+// libusb transfer status to the urb status usbmon would report
+int32_t usbmon_status(char event, int status) {
+	if(event == 'S') return -EINPROGRESS;
+	if(status < 0) return status;
+	switch(status) {
+	case 0: return 0;   // LIBUSB_TRANSFER_COMPLETED
+	case 2: return -ETIMEDOUT;
+	case 3: return -ENOENT;
+	case 4: return -EPIPE;
+	case 5: return -ENODEV;
+	case 6: return -EOVERFLOW;
+	default: return -EPROTO;
+	}
+}
+
+// empty slot: Custom Block carrying just our PEN and a kind tag
+void write_empty(uint8_t *slot, size_t slot_size) {
+	memset(slot,0,slot_size);
+	put32(slot,PCAPNG_CB);
+	put32(slot + 4,slot_size);
+	put32(slot + 8,CAPTURE_PEN);
+	put32(slot + 12,CUSTOM_EMPTY);
+	put32(slot + slot_size - 4,slot_size);
+}
+
+} //namespace
+
+/* ------------------------------------ */
+
+capture::capture(const char *path, size_t size, size_t _slot_size)
+:fd(-1),map(0),map_size(0),slot_size(pad4(std::max<size_t>(_slot_size,128))),
+ slot_count(0),ring_offset(0),next_slot(0)
+{
+	const size_t shb_len = 28;
+	const size_t idb_len = 20;
+	ring_offset = shb_len + idb_len;
+	
+	slot_count = size > ring_offset ? (size - ring_offset) / slot_size : 0;
+	if(!slot_count) {
+		LOG_ERROR(app,"capture size %zu is too small",size);
+		return;
+	}
+	map_size = ring_offset + slot_count * slot_size;
+	
+	fd = open(path,O_RDWR | O_CREAT | O_TRUNC,0644);
+	if(fd < 0 || ftruncate(fd,map_size)) {
+		LOG_ERROR(app,"Unable to create capture file %s: %s",path,strerror(errno));
+		return;
+	}
+	
+	void *m = mmap(0,map_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+	if(m == MAP_FAILED) {
+		LOG_ERROR(app,"Unable to map capture file %s: %s",path,strerror(errno));
+		map = 0;
+		return;
+	}
+	map = (uint8_t*)m;
+	
+	uint8_t *shb = map;
+	put32(shb,PCAPNG_SHB);
+	put32(shb + 4,shb_len);
+	put32(shb + 8,PCAPNG_BOM);
+	put16(shb + 12,1);
+	put16(shb + 14,0);
+	put32(shb + 16,0xffffffff); // section length unknown
+	put32(shb + 20,0xffffffff);
+	put32(shb + 24,shb_len);
+	
+	uint8_t *idb = map + shb_len;
+	put32(idb,PCAPNG_IDB);
+	put32(idb + 4,idb_len);
+	put16(idb + 8,LINKTYPE_USB_LINUX_MMAPPED);
+	put16(idb + 10,0);
+	put32(idb + 12,slot_size);
+	put32(idb + 16,idb_len);
+	
+	for(size_t i = 0; i < slot_count; i++) {
+		write_empty(map + ring_offset + i * slot_size,slot_size);
+	}
+	
+	LOG_INFO(app,"capturing to %s, %zu slots of %zu bytes",path,slot_count,slot_size);
+}
+
+capture::~capture() {
+	if(map) munmap(map,map_size);
+	if(fd >= 0) close(fd);
+}
+
+capture::operator bool() const {
+	return map != 0;
+}
+
+uint8_t* capture::claim_slot() {
+	const uint64_t n = next_slot.fetch_add(1,std::memory_order_relaxed);
+	return map + ring_offset + (n % slot_count) * slot_size;
+}
+
+void capture::usb(uint64_t id, char event,
+                  uint8_t xfer_type, uint8_t endpoint,
+                  uint8_t devnum, uint16_t busnum,
+                  int status, uint32_t length,
+                  const uint8_t *setup,
+                  const void *data, size_t data_len)
+{
+	if(!map) return;
+	
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	
+	// EPB header (28) + trailing length (4) + custom filler option (8)
+	// + end of options (4) leave this much room for usbmon header and data
+	const size_t room = slot_size - 44 - sizeof(usbmon_packet);
+	const size_t len_cap = std::min(data ? data_len : 0,room & ~(size_t)3);
+	
+	usbmon_packet hdr;
+	memset(&hdr,0,sizeof(hdr));
+	hdr.id = id;
+	hdr.type = event;
+	hdr.xfer_type = usbmon_xfer_type[xfer_type & 3];
+	hdr.epnum = endpoint;
+	hdr.devnum = devnum;
+	hdr.busnum = busnum;
+	hdr.flag_setup = setup ? 0 : '-';
+	hdr.flag_data = data_len ? 0 : (endpoint & 0x80 ? '<' : '>');
+	hdr.ts_sec = ts.tv_sec;
+	hdr.ts_usec = ts.tv_nsec / 1000;
+	hdr.status = usbmon_status(event,status);
+	hdr.length = length;
+	hdr.len_cap = len_cap;
+	if(setup) memcpy(hdr.setup,setup,sizeof(hdr.setup));
+	
+	const uint32_t packet_len = sizeof(hdr) + len_cap;
+	const uint64_t usec = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	
+	uint8_t *slot = claim_slot();
+	put32(slot,PCAPNG_EPB);
+	put32(slot + 4,slot_size);
+	put32(slot + 8,0);
+	put32(slot + 12,usec >> 32);
+	put32(slot + 16,usec & 0xffffffff);
+	put32(slot + 20,packet_len);
+	put32(slot + 24,sizeof(hdr) + data_len);
+	memcpy(slot + 28,&hdr,sizeof(hdr));
+	if(len_cap) memcpy(slot + 28 + sizeof(hdr),data,len_cap);
+	
+	// pad the slot with a custom binary option, readers skip it
+	uint8_t *opt = slot + 28 + pad4(packet_len);
+	uint8_t *end = slot + slot_size - 8;
+	memset(opt,0,end - opt);
+	put16(opt,PCAPNG_OPT_CUSTOM_BIN);
+	put16(opt + 2,end - opt - 4);
+	put32(opt + 4,CAPTURE_PEN);
+	put16(end,PCAPNG_OPT_ENDOFOPT);
+	put16(end + 2,0);
+	put32(slot + slot_size - 4,slot_size);
+}
+
+void capture::stream(stream_event_t event, uint32_t channel, const void *data, size_t len) {
+	if(!map) return;
+	
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME,&ts);
+	
+	// CB header (8) + trailing length (4)
+	const size_t len_cap = std::min(len,slot_size - 12 - sizeof(stream_record));
+	
+	stream_record r;
+	r.pen = CAPTURE_PEN;
+	r.kind = CUSTOM_STREAM;
+	r.timestamp = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	r.event = event;
+	r.channel = channel;
+	r.length = len;
+	r.len_cap = len_cap;
+	
+	uint8_t *slot = claim_slot();
+	put32(slot,PCAPNG_CB);
+	put32(slot + 4,slot_size);
+	memcpy(slot + 8,&r,sizeof(r));
+	memcpy(slot + 8 + sizeof(r),data,len_cap);
+	put32(slot + slot_size - 4,slot_size);
+}
+
+capture* capture::instance() {
+	static capture *c = []() -> capture* {
+		const char *path = getenv("AKEMI_CAPTURE");
+		if(!path) return 0;
+		
+		size_t size = 16 << 20;
+		if(const char *s = getenv("AKEMI_CAPTURE_SIZE")) {
+			size = strtoul(s,0,0);
+		}
+		
+		static capture cap(path,size);
+		return cap ? &cap : 0;
+	}();
+	return c;
+}
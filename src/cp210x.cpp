@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <conv.h>
+#include <log.h>
+#include <algorithm>
+#include <unistd.h>
 
 #include <boost/shared_array.hpp>
 #include <boost/bind.hpp>
@@ -48,6 +51,8 @@
 #define CP210X_GET_BAUDRATE     0x1d
 #define CP210X_SET_BAUDRATE     0x1e
 #define CP210X_PURGE            0x12
+#define CP210X_SET_MHS          0x07
+#define CP210X_GET_MDMSTS       0x08
 
 #define UART_ENABLE             0x0001
 #define UART_DISABLE            0x0000
@@ -55,27 +60,88 @@
 #define PURGE_TRANSMIT_QUEUE    (1 << 0)
 #define PURGE_RECEIVE_QUEUE     (1 << 1)
 
+#define DEFAULT_MAX_PACKET_SIZE 64
+
+#define DEFAULT_SEND_HIGH_WATER (64 * 1024)
+#define DEFAULT_SEND_LOW_WATER  (16 * 1024)
+
 usb::device cp210x::find_device(const usb::context &context, uint16_t vid, uint16_t pid)
 {
+	if(usb::device_registry *registry = context.registry()) {
+		std::vector<usb::device> devices = registry->find(vid,pid);
+		return devices.empty() ? usb::device(nullptr) : devices.front();
+	}
+	
 	usb::device_list devices(context);
 	
 	return devices.find(vid,pid);
 }
 
-cp210x::cp210x(const usb::context &ctx, bool _auto_recv)
+std::vector<usb::device> cp210x::find_devices(const usb::context &context) {
+	if(usb::device_registry *registry = context.registry()) {
+		return registry->find(VENDOR_ID,PRODUCT_ID);
+	}
+	
+	usb::device_list devices(context);
+	
+	return devices.find_all(VENDOR_ID,PRODUCT_ID);
+}
+
+bool cp210x::is_adapter(const usb::device &dev) {
+	usb::device_descriptor desc = dev.descriptor();
+	return desc && desc.idVendor == VENDOR_ID && desc.idProduct == PRODUCT_ID;
+}
+
+cp210x::cp210x(const usb::context &ctx, bool _auto_recv,
+               size_t recv_depth, size_t recv_packets,
+               size_t send_depth, events_t events)
+    : cp210x(ctx,find_device(ctx,VENDOR_ID,PRODUCT_ID),_auto_recv,
+             recv_depth,recv_packets,send_depth,events) {
+}
+
+cp210x::cp210x(const usb::context &ctx, const usb::device &dev, bool _auto_recv,
+               size_t recv_depth, size_t recv_packets,
+               size_t send_depth, events_t events)
     : context(ctx),
-	  device(find_device(context,VENDOR_ID,PRODUCT_ID)),
+	  device(dev),
       handle(device,true),
 	  conf(handle,1),
 	  interface_number(0),
 	  iface(handle,interface_number),
-	  recv_transfer(handle,LIBUSB_TRANSFER_TYPE_BULK,UART_ENDPOINT_IN,0,1000),
+	  recv_head(0),
+	  recv_tail(0),
+	  recv_pending(0),
+	  recv_degraded(false),
+	  send_order_base(0),
+	  send_policy(send_queue),
+	  send_queued(0),
+	  send_high_water(DEFAULT_SEND_HIGH_WATER),
+	  send_low_water(DEFAULT_SEND_LOW_WATER),
+	  send_congested(false),
+	  send_reported(false),
+	  send_max_packet(DEFAULT_MAX_PACKET_SIZE),
+	  coalesce_size(0),
+	  coalesce_deadline_ns(0),
+	  coalesce_stop(false),
 	  completed(0),
+	  realtime_replay(true),
 	  auto_recv(_auto_recv) {
+	invalidate_shadow();
+	
 	if(!handle) {
-		fprintf(stderr,"Cannot open cp210x device\n");
+		LOG_ERROR(cp210x,"Cannot open cp210x device");
 		return;
 	}
+	
+	if(usb::device_registry *registry = context.registry()) {
+		libusb_device *self = device;
+		device_left_connection = registry->device_left.connect([this,self](usb::device dev) {
+			if((libusb_device*)dev == self) {
+				LOG_INFO(cp210x,"cp210x left, dropping cached line settings");
+				invalidate_shadow();
+			}
+		});
+	}
 	//printf("cp210x device descriptor:\n");
 	//device.descriptor().print("-> ");
 	
@@ -87,32 +153,211 @@ cp210x::cp210x(const usb::context &ctx, bool _auto_recv)
 		printf("Cannot purge device io queues\n");
 	}*/
 	
-	auto recv_callback = [this](usb::transfer *tr) {
-		//fprintf(stderr,"cp210x::recv_callback\n");
-		this->data_received(tr->status(),tr->buffer().get(),tr->actual_length());
-		
-		if(this->auto_recv) {
-			tr->submit();
-		}
-	};
-	
-	recv_transfer.allocate_buffer(64);
-	recv_transfer.transfer_completed.connect(recv_callback);
+	init_recv_ring(recv_depth,recv_packets);
+	init_send_pool(send_depth);
 	
-	io_thread = boost::thread(boost::bind(&cp210x::io_thread_func,this));
+	if(events == events_thread) {
+		io_thread = boost::thread(boost::bind(&cp210x::io_thread_func,this));
+	} else {
+		start_recv();
+	}
 }
 
 cp210x::~cp210x() {
-	auto_recv = false;
 	completed = 1;
 	//io_thread.interrupt();
-	io_thread.join();
+	if(io_thread.joinable()) {
+		io_thread.join();
+	} else if(handle) {
+		stop_transfers();
+	}
 }
 
-void cp210x::io_thread_func() {
+void cp210x::init_recv_ring(size_t depth, size_t packets) {
+	int max_packet = usb::config_descriptor(device).max_packet_size(UART_ENDPOINT_IN);
+	if(max_packet <= 0) {
+		LOG_WARNING(cp210x,"Cannot read wMaxPacketSize of endpoint 0x%hhX, using %i",
+		            UART_ENDPOINT_IN,DEFAULT_MAX_PACKET_SIZE);
+		max_packet = DEFAULT_MAX_PACKET_SIZE;
+	}
+	
+	const size_t transfer_len = max_packet * std::max<size_t>(packets,1);
+	depth = std::max<size_t>(depth,1);
+	
+	// twice the ring depth so that consumers holding on to delivered
+	// chunks do not force allocations in steady state
+	recv_pool = buffer_pool::create(transfer_len,depth * 2);
+	
+	for(size_t i = 0; i < depth; i++) {
+		boost::shared_ptr<usb::transfer> tr(new usb::transfer(handle,LIBUSB_TRANSFER_TYPE_BULK,
+		                                                      UART_ENDPOINT_IN,0,1000));
+		shared_buffer buffer = recv_pool->acquire();
+		tr->set_buffer(buffer.data(),buffer.size());
+		tr->transfer_completed.connect(boost::bind(&cp210x::recv_completed,this,i));
+		
+		recv_ring.push_back(tr);
+		recv_buffers.push_back(buffer);
+		recv_ready.push_back(false);
+	}
+}
+
+// must be called with recv_mutex held
+int cp210x::submit_recv() {
+	if(recv_pending == recv_ring.size()) {
+		return -1;
+	}
+	
+	int ret = recv_ring[recv_tail]->submit();
+	if(ret == 0) {
+		recv_tail = (recv_tail + 1) % recv_ring.size();
+		recv_pending++;
+	}
+	return ret;
+}
+
+// must be called with recv_mutex held; queues every free slot, which
+// also retries submissions that failed earlier
+void cp210x::refill_recv() {
+	int ret = 0;
+	while(recv_pending != recv_ring.size() && (ret = submit_recv()) == 0);
+	
+	if(ret == 0) {
+		if(recv_degraded) {
+			LOG_INFO(cp210x,"bulk IN ring refilled to %zu transfers",recv_ring.size());
+			recv_degraded = false;
+		}
+	} else if(!recv_pending) {
+		LOG_ERROR(cp210x,"Cannot submit any bulk IN transfer: %s, reception stopped",libusb_error_name(ret));
+		recv_degraded = true;
+	} else if(!recv_degraded) {
+		LOG_WARNING(cp210x,"Cannot resubmit bulk IN transfer: %s, %zu of %zu queued",
+		            libusb_error_name(ret),recv_pending,recv_ring.size());
+		recv_degraded = true;
+	}
+}
+
+void cp210x::recv_completed(size_t slot) {
+	boost::unique_lock<boost::mutex> lock(recv_mutex);
+	
+	recv_ready[slot] = true;
+	
+	// a transfer finishing early (timeout, cancel) is held back until
+	// everything submitted before it has been delivered
+	while(recv_ready[recv_head]) {
+		usb::transfer *tr = recv_ring[recv_head].get();
+		const int status = tr->status();
+		
+		// hand the filled block over to consumers and give the transfer
+		// a fresh one before it can be resubmitted
+		shared_buffer buffer = recv_buffers[recv_head].slice(0,tr->actual_length());
+		buffer.set_timestamp(tr->completed_at());
+		recv_buffers[recv_head] = recv_pool->acquire();
+		tr->set_buffer(recv_buffers[recv_head].data(),recv_buffers[recv_head].size());
+		
+		recv_ready[recv_head] = false;
+		recv_head = (recv_head + 1) % recv_ring.size();
+		recv_pending--;
+		
+		lock.unlock();
+		data_received(status,buffer.data(),buffer.size());
+		buffer_received(status,buffer);
+		lock.lock();
+		
+		if(auto_recv) {
+			refill_recv();
+		}
+	}
+}
+
+void cp210x::start_recv() {
+	boost::lock_guard<boost::mutex> lock(recv_mutex);
 	if(auto_recv) {
-		recv_transfer.submit();
+		refill_recv();
+	}
+}
+
+size_t cp210x::in_flight() {
+	size_t count = 0;
+	{
+		boost::lock_guard<boost::mutex> lock(recv_mutex);
+		count += recv_pending;
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		count += send_pool.size() - send_free.size();
+	}
+	{
+		boost::lock_guard<boost::mutex> lock(control_mutex);
+		count += control_active.size();
+	}
+	return count;
+}
+
+void cp210x::stop_transfers() {
+	stop_coalescing();
+	
+	data_received.disconnect_all_slots();
+	buffer_received.disconnect_all_slots();
+	send_backpressure.disconnect_all_slots();
+	
+	{
+		// completions racing this on another event thread check
+		// auto_recv under the same lock, none resubmits after the cancel
+		boost::lock_guard<boost::mutex> lock(recv_mutex);
+		auto_recv = false;
+		for(auto tr : recv_ring) {
+			tr->cancel();
+		}
+	}
+	
+	std::vector<send_completion> ready;
+	bool crossed;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		
+		// queued sends are reported as cancelled, in order once the
+		// transfers ahead of them completed
+		for(auto &request : send_backlog) {
+			send_completion &c = send_order[request.seq - send_order_base];
+			c.done = true;
+			c.status = LIBUSB_TRANSFER_CANCELLED;
+		}
+		send_backlog.clear();
+		
+		std::vector<bool> idle(send_pool.size(),false);
+		for(auto i : send_free) idle[i] = true;
+		for(size_t i = 0; i < send_pool.size(); i++) {
+			if(!idle[i]) send_pool[i]->cancel();
+		}
+		
+		crossed = collect_sends(ready);
+	}
+	
+	deliver_sends(ready,crossed);
+	
+	{
+		boost::lock_guard<boost::mutex> lock(control_mutex);
+		for(auto tr : control_active) {
+			tr->cancel();
+		}
+	}
+	
+	// reap the cancellations before the transfers are freed, libusb
+	// completes every cancelled transfer eventually (also once the
+	// device is gone), freeing one still in flight would be fatal
+	for(size_t i = 1; ; i++) {
+		const size_t left = in_flight();
+		if(!left) break;
+		if(i % 50 == 0) {
+			LOG_WARNING(cp210x,"still waiting for %zu cancelled transfers",left);
+		}
+		struct timeval tv = { 0, 100000 };
+		libusb_handle_events_timeout_completed(context,&tv,0);
 	}
+}
+
+void cp210x::io_thread_func() {
+	start_recv();
 	
 	while(!completed) {
 		//fprintf(stderr,"io_thread_func\n");
@@ -121,28 +366,85 @@ void cp210x::io_thread_func() {
 		struct timeval tv = { 3, 0 };
 		//context.handle_events_timeout(&tv);
 		libusb_handle_events_timeout_completed(context,&tv,&completed);
+		
+		// retries failed submissions also once the ring ran dry and no
+		// completion is left to refill it
+		if(!completed) {
+			start_recv();
+		}
 	}
 	
-	fprintf(stderr,"io_thread_func stop\n");
+	LOG_DEBUG(cp210x,"io_thread_func stop");
 	
-	data_received.disconnect_all_slots();
+	stop_transfers();
+
+	LOG_DEBUG(cp210x,"io_thread_func completed");
+}
+
+int cp210x::replay(const char *path, bool realtime) {
+	if(handle || player) {
+		LOG_ERROR(cp210x,"Cannot replay usb trace while a device is attached");
+		return -1;
+	}
+	
+	boost::shared_ptr<usb::trace_player> p(new usb::trace_player(path));
+	if(!*p) return -1;
+	
+	player = p;
+	realtime_replay = realtime;
+	recv_pool = buffer_pool::create(DEFAULT_MAX_PACKET_SIZE * 8,8);
+	
+	io_thread = boost::thread(boost::bind(&cp210x::replay_thread_func,this));
+	return 0;
+}
+
+void cp210x::replay_thread_func() {
+	usb::trace_record record;
+	std::vector<uint8_t> payload;
+	
+	const uint64_t start = usb::monotonic_ns();
+	uint64_t first = 0;
+	
+	while(!completed && player->next(record,payload)) {
+		const bool recv = (record.event == usb::trace_complete ||
+		                   record.event == usb::trace_bulk) &&
+		                  record.endpoint == UART_ENDPOINT_IN;
+		if(!recv) continue;
 		
-	recv_transfer.cancel();
+		if(!first) first = record.timestamp;
 		
-	for(size_t i = 0; i < 2; i++) {
-		struct timeval tv = { 0, 0 };
-		context.handle_events_timeout(&tv);
-	}		
-
-	fprintf(stderr,"io_thread_func completed\n");
+		// sleep in short slices so that the destructor is not held up
+		// by long gaps in the recording
+		while(realtime_replay && !completed) {
+			const uint64_t due = start + (record.timestamp - first);
+			const uint64_t now = usb::monotonic_ns();
+			if(due <= now) break;
+			usleep(std::min<uint64_t>((due - now) / 1000,100000));
+		}
+		
+		size_t offset = 0;
+		do {
+			shared_buffer buffer = recv_pool->acquire();
+			const size_t len = std::min(payload.size() - offset,buffer.size());
+			if(len) memcpy(buffer.data(),&payload[offset],len);
+			offset += len;
+			
+			buffer = buffer.slice(0,len);
+			buffer.set_timestamp(usb::monotonic_ns());
+			data_received(record.status,buffer.data(),buffer.size());
+			buffer_received(record.status,buffer);
+		} while(offset < payload.size());
+	}
+	
+	LOG_INFO(cp210x,"replay_thread_func completed");
 }
 
 uint32_t cp210x::get_baud() {
 	uint32_t baud = 0;
 	if(get_interface_config(CP210X_GET_BAUDRATE,&baud,sizeof(baud)) != sizeof(baud)) {
-		printf("Cannot retrieve baud\n");	
+		LOG_ERROR(cp210x,"Cannot retrieve baud");	
 	} else {
-		printf("Current baud = %i\n",baud);
+		LOG_DEBUG(cp210x,"Current baud = %u",baud);
 	}
 	return baud;
 }
@@ -151,75 +453,220 @@ int cp210x::set_baud(uint32_t baud) {
 	return set_interface_config(CP210X_SET_BAUDRATE,&baud,sizeof(baud)) == sizeof(baud);	
 }
 
+static const char* data_bits_name(uint16_t ctl) {
+	switch(ctl & cp210x::data_mask) {
+	case cp210x::data5: return "5";
+	case cp210x::data6: return "6";
+	case cp210x::data7: return "7";
+	case cp210x::data8: return "8";
+	case cp210x::data9: return "9";
+	default: return "unknown";
+	}
+}
+
+static const char* parity_name(uint16_t ctl) {
+	switch(ctl & cp210x::parity_mask) {
+	case cp210x::parity_none:  return "NONE";
+	case cp210x::parity_odd:   return "ODD";
+	case cp210x::parity_even:  return "EVEN";
+	case cp210x::parity_mark:  return "MARK";
+	case cp210x::parity_space: return "SPACE";
+	default: return "unknown";
+	}
+}
+
+static const char* stop_bits_name(uint16_t ctl) {
+	switch(ctl & cp210x::stop_mask) {
+	case cp210x::stop1:   return "1";
+	case cp210x::stop1_5: return "1.5";
+	case cp210x::stop2:   return "2";
+	default: return "unknown";
+	}
+}
+
 uint16_t cp210x::get_ctl() {
 	uint16_t ctl = 0;
 	if(get_interface_config(CP210X_GET_LINE_CTL,&ctl,sizeof(ctl)) != sizeof(ctl)) {
-		printf("Cannot retrieve ctl\n");	
+		LOG_ERROR(cp210x,"Cannot retrieve ctl");	
 	} else {
-		switch(ctl & data_mask) {
-		case data5:
-			printf("data bits = 5\n");
-			break;
-		case data6:
-			printf("data bits = 6\n");
-			break;
-		case data7:
-			printf("data bits = 7\n");
-			break;
-		case data8:
-			printf("data bits = 8\n");
-			break;
-		case data9:
-			printf("data bits = 9\n");
-			break;
-		default:
-			printf("data bits = unknown\n");
-			break;
-		}
-		
-		switch(ctl & parity_mask) {
-		case parity_none:
-			printf("parity = NONE\n");
-			break;
-		case parity_odd:
-			printf("parity = ODD\n");
-			break;
-		case parity_even:
-			printf("parity = EVEN\n");
-			break;
-		case parity_mark:
-			printf("parity = MARK\n");
-			break;
-		case parity_space:
-			printf("parity = SPACE\n");
-			break;
-		default:
-			printf("parity = unknown\n");
-			break;
-		}
-		
-		switch(ctl & stop_mask) {
-		case stop1:
-			printf("stop bits = 1\n");
-			break;
-		case stop1_5:
-			printf("stop bits = 1.5\n");
-			break;
-		case stop2:
-			printf("stop bits = 2\n");
-			break;
-		default:
-			printf("stop bits = unknown\n");
-			break;
-		}
+		LOG_DEBUG(cp210x,"data bits = %s, parity = %s, stop bits = %s",
+		          data_bits_name(ctl),parity_name(ctl),stop_bits_name(ctl));
 	}
 	return ctl;
 }
 
 int cp210x::set_ctl(uint16_t ctl) {
-	return set_interface_config(CP210X_SET_LINE_CTL,&ctl,sizeof(ctl)) == sizeof(ctl);	
+	// sent in wValue, nothing is transferred in the data stage
+	return set_interface_config(CP210X_SET_LINE_CTL,&ctl,sizeof(ctl)) >= 0;	
+}
+
+cp210x::flow_t cp210x::get_flow() {
+	flow_t flow;
+	memset(&flow,0,sizeof(flow));
+	if(get_interface_config(CP210X_GET_FLOW,&flow,sizeof(flow)) != sizeof(flow)) {
+		LOG_ERROR(cp210x,"Cannot retrieve flow control");
+	}
+	return flow;
+}
+
+int cp210x::set_flow(const flow_t &flow) {
+	return set_interface_config(CP210X_SET_FLOW,&flow,sizeof(flow)) == sizeof(flow);
+}
+
+uint8_t cp210x::get_modem_status(bool refresh) {
+	if(refresh) {
+		boost::lock_guard<boost::mutex> lock(shadow_mutex);
+		shadow.valid[shadow_modem] = false;
+	}
+	
+	uint8_t status = 0;
+	if(get_interface_config(CP210X_GET_MDMSTS,&status,sizeof(status)) != sizeof(status)) {
+		LOG_ERROR(cp210x,"Cannot retrieve modem status");
+	}
+	return status;
+}
+
+int cp210x::set_modem_control(uint8_t lines, uint8_t mask) {
+	uint16_t mhs = (uint16_t)(mask & (modem_dtr | modem_rts)) << 8 | (lines & mask);
+	return set_interface_config(CP210X_SET_MHS,&mhs,sizeof(mhs)) >= 0;
+}
+
+int cp210x::reset() {
+	invalidate_shadow();
+	
+	if(set_interface_config_single(CP210X_IFC_ENABLE,UART_DISABLE) < 0 ||
+	   set_interface_config_single(CP210X_IFC_ENABLE,UART_ENABLE) < 0) {
+		LOG_ERROR(cp210x,"Cannot reset UART");
+		return -1;
+	}
+	return 0;
+}
+
+/* ------------------------------------ */
+
+static void baud_completed(boost::function<void (int status, uint32_t baud)> callback,
+                           int status, const uint8_t *data, size_t len)
+{
+	uint32_t baud = 0;
+	if(status == LIBUSB_TRANSFER_COMPLETED && len != sizeof(baud)) {
+		status = LIBUSB_TRANSFER_ERROR;
+	}
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		memcpy(&baud,data,sizeof(baud));
+	}
+	callback(status,baud);
 }
 
+int cp210x::get_baud_async(boost::function<void (int status, uint32_t baud)> callback) {
+	return get_interface_config_async(CP210X_GET_BAUDRATE,sizeof(uint32_t),
+	                                  boost::bind(baud_completed,callback,_1,_2,_3));
+}
+
+int cp210x::set_baud_async(uint32_t baud, config_callback callback) {
+	return set_interface_config_async(CP210X_SET_BAUDRATE,&baud,sizeof(baud),callback);
+}
+
+static void ctl_completed(boost::function<void (int status, uint16_t ctl)> callback,
+                          int status, const uint8_t *data, size_t len)
+{
+	uint16_t ctl = 0;
+	if(status == LIBUSB_TRANSFER_COMPLETED && len != sizeof(ctl)) {
+		status = LIBUSB_TRANSFER_ERROR;
+	}
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		memcpy(&ctl,data,sizeof(ctl));
+	}
+	callback(status,ctl);
+}
+
+int cp210x::get_ctl_async(boost::function<void (int status, uint16_t ctl)> callback) {
+	return get_interface_config_async(CP210X_GET_LINE_CTL,sizeof(uint16_t),
+	                                  boost::bind(ctl_completed,callback,_1,_2,_3));
+}
+
+int cp210x::set_ctl_async(uint16_t ctl, config_callback callback) {
+	return set_interface_config_async(CP210X_SET_LINE_CTL,&ctl,sizeof(ctl),callback);
+}
+
+int cp210x::set_flow_async(const flow_t &flow, config_callback callback) {
+	return set_interface_config_async(CP210X_SET_FLOW,&flow,sizeof(flow),callback);
+}
+
+int cp210x::purge_async(uint16_t queues, config_callback callback) {
+	return set_interface_config_async(CP210X_PURGE,&queues,sizeof(queues),callback);
+}
+
+/* ------------------------------------ */
+
+cp210x::batch& cp210x::batch::add(uint8_t code, const void *data, size_t len) {
+	request r;
+	r.code = code;
+	r.data.assign((const uint8_t*)data,(const uint8_t*)data + len);
+	requests.push_back(r);
+	return *this;
+}
+
+cp210x::batch& cp210x::batch::baud(uint32_t baud) {
+	return add(CP210X_SET_BAUDRATE,&baud,sizeof(baud));
+}
+
+cp210x::batch& cp210x::batch::ctl(uint16_t ctl) {
+	return add(CP210X_SET_LINE_CTL,&ctl,sizeof(ctl));
+}
+
+cp210x::batch& cp210x::batch::flow(const flow_t &flow) {
+	return add(CP210X_SET_FLOW,&flow,sizeof(flow));
+}
+
+cp210x::batch& cp210x::batch::purge(uint16_t queues) {
+	return add(CP210X_PURGE,&queues,sizeof(queues));
+}
+
+size_t cp210x::batch::size() const {
+	return requests.size();
+}
+
+// submits request `index` of the batch, the completion of every
+// request submits the next one until the batch is done or fails
+void cp210x::batch_step(boost::shared_ptr<batch> b, size_t index,
+                        config_callback callback, int status)
+{
+	if(status != LIBUSB_TRANSFER_COMPLETED || index == b->requests.size()) {
+		if(status != LIBUSB_TRANSFER_COMPLETED) {
+			LOG_WARNING(cp210x,"batch request %zu/%zu (0x%02hhX) failed: %i",
+			            index,b->requests.size(),b->requests[index - 1].code,status);
+		}
+		if(callback) callback(status);
+		return;
+	}
+	
+	const batch::request &r = b->requests[index];
+	int result = set_interface_config_async(r.code,r.data.data(),r.data.size(),
+	                                        boost::bind(&cp210x::batch_step,this,b,index + 1,
+	                                                    callback,_1));
+	if(result < 0 && callback) {
+		callback(result);
+	}
+}
+
+int cp210x::submit(const batch &b, config_callback callback) {
+	if(!handle) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if(b.requests.empty()) {
+		if(callback) callback(LIBUSB_TRANSFER_COMPLETED);
+		return 0;
+	}
+	
+	boost::shared_ptr<batch> copy(new batch(b));
+	const batch::request &r = copy->requests.front();
+	return set_interface_config_async(r.code,r.data.data(),r.data.size(),
+	                                  boost::bind(&cp210x::batch_step,this,copy,1,
+	                                              callback,_1));
+}
+
+/* ------------------------------------ */
+
 int cp210x::send(void *buffer, size_t len, uint32_t timeout) {
 	int transferred = 0;
 	
@@ -237,29 +684,410 @@ int cp210x::recv(void *buffer, size_t len, uint32_t timeout) {
 }
 
 int cp210x::recv_async() {
-	return auto_recv ? -1 : recv_transfer.submit();
+	if(recv_ring.empty()) return -1;
+	
+	boost::lock_guard<boost::mutex> lock(recv_mutex);
+	if(auto_recv) return -1;
+	return submit_recv();
+}
+
+void cp210x::init_send_pool(size_t depth) {
+	int max_packet = usb::config_descriptor(device).max_packet_size(UART_ENDPOINT_OUT);
+	if(max_packet > 0) {
+		send_max_packet = max_packet;
+	}
+	
+	for(size_t i = 0; i < std::max<size_t>(depth,1); i++) {
+		boost::shared_ptr<usb::transfer> tr(new usb::transfer(handle,LIBUSB_TRANSFER_TYPE_BULK,
+		                                                      UART_ENDPOINT_OUT,0,1000));
+		tr->transfer_completed.connect(boost::bind(&cp210x::send_completed,this,i));
+		
+		send_pool.push_back(tr);
+		send_seq.push_back(0);
+		send_started.push_back(0);
+		send_free.push_back(i);
+	}
+}
+
+// must be called with send_mutex held
+int cp210x::submit_send(size_t slot, const send_request &request) {
+	usb::transfer *tr = send_pool[slot].get();
+	tr->set_buffer(request.buffer,request.len);
+	tr->set_timeout(request.timeout);
+	tr->set_flags(request.zero_packet ? LIBUSB_TRANSFER_ADD_ZERO_PACKET : 0);
+	
+	int ret = tr->submit();
+	if(ret == 0) {
+		send_seq[slot] = request.seq;
+		send_started[slot] = request.queued_ns;
+	}
+	return ret;
+}
+
+// must be called with send_mutex held; takes the completions that are
+// next in submission order, returns true when a water mark was crossed
+bool cp210x::collect_sends(std::vector<send_completion> &ready) {
+	size_t released = 0;
+	while(!send_order.empty() && send_order.front().done) {
+		released += send_order.front().len;
+		ready.push_back(send_order.front());
+		send_order.pop_front();
+		send_order_base++;
+	}
+	return account_send(0,released);
+}
+
+// must be called with send_mutex held
+bool cp210x::account_send(size_t added, size_t released) {
+	send_queued += added;
+	send_queued -= std::min(released,send_queued);
+	
+	if(!send_congested && send_high_water && send_queued >= send_high_water) {
+		send_congested = true;
+		return true;
+	}
+	if(send_congested && send_queued <= send_low_water) {
+		send_congested = false;
+		return true;
+	}
+	return false;
+}
+
+// must be called with send_mutex held
+bool cp210x::over_high_water(size_t len) const {
+	return send_high_water && send_queued + len > send_high_water;
+}
+
+void cp210x::deliver_sends(std::vector<send_completion> &ready, bool crossed) {
+	for(auto &c : ready) {
+		if(c.callback) {
+			c.callback(c.status,c.actual_length);
+		}
+	}
+	
+	if(crossed) {
+		// serialized so that listeners see transitions in order
+		boost::lock_guard<boost::recursive_mutex> lock(backpressure_mutex);
+		bool congested;
+		{
+			boost::lock_guard<boost::mutex> send_lock(send_mutex);
+			congested = send_congested;
+			if(congested == send_reported) return;
+			send_reported = congested;
+		}
+		
+		LOG_DEBUG(cp210x,"send queue %s",congested ? "congested" : "drained");
+		send_backpressure(congested);
+	}
+}
+
+void cp210x::send_completed(size_t slot) {
+	usb::transfer *tr = send_pool[slot].get();
+	
+	std::vector<send_completion> ready;
+	bool crossed;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		send_completion &c = send_order[send_seq[slot] - send_order_base];
+		c.done = true;
+		c.status = tr->status();
+		c.actual_length = tr->actual_length();
+		send_wait.record(usb::monotonic_ns() - send_started[slot]);
+		
+		bool recycled = false;
+		while(!recycled && !send_backlog.empty()) {
+			send_request request = send_backlog.front();
+			send_backlog.pop_front();
+			
+			if(submit_send(slot,request) == 0) {
+				recycled = true;
+			} else {
+				send_completion &f = send_order[request.seq - send_order_base];
+				f.done = true;
+				f.status = LIBUSB_TRANSFER_ERROR;
+			}
+		}
+		
+		if(!recycled) {
+			send_free.push_back(slot);
+		}
+		
+		crossed = collect_sends(ready);
+	}
+	
+	deliver_sends(ready,crossed);
 }
 
 int cp210x::send_async(void *buffer, size_t len,
-                       boost::function<void (int status, size_t bytes_transferred)> callback, 
+                       send_callback callback, 
 					   uint32_t timeout) {
-	boost::shared_ptr<usb::transfer> t(new usb::transfer(handle,LIBUSB_TRANSFER_TYPE_BULK,
-	                                                     UART_ENDPOINT_OUT,0,timeout));
-	t->set_buffer(buffer,len);
+	if(player) {
+		if(callback) {
+			callback(LIBUSB_TRANSFER_COMPLETED,len);
+		}
+		return 0;
+	}
+	
+	if(coalesce_size && len <= coalesce_size) {
+		return coalesce(buffer,len,callback,timeout);
+	}
+	
+	send_request request = { buffer, len, callback, timeout, usb::monotonic_ns(), false, 0 };
+	
+	std::vector<send_completion> ready;
+	bool crossed = false;
+	int ret;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		if(send_policy == send_fail && over_high_water(len)) {
+			return LIBUSB_ERROR_BUSY;
+		}
+		
+		// merged writes queued before this one go out first
+		flush_batch();
+		ret = enqueue_send(request,send_policy == send_queue);
+		if(ret == 0) {
+			crossed = account_send(len,0);
+		}
+		crossed |= collect_sends(ready);
+	}
+	
+	deliver_sends(ready,crossed);
+	return ret;
+}
+
+// must be called with send_mutex held; the request takes its place in
+// the callback order once it is submitted or queued
+int cp210x::enqueue_send(send_request request, bool may_queue) {
+	request.seq = send_order_base + send_order.size();
+	
+	if(send_free.empty()) {
+		if(!may_queue || send_pool.empty()) {
+			return LIBUSB_ERROR_BUSY;
+		}
+		send_backlog.push_back(request);
+	} else {
+		size_t slot = send_free.back();
+		int ret = submit_send(slot,request);
+		if(ret != 0) {
+			return ret;
+		}
+		send_free.pop_back();
+	}
+	
+	send_completion c = { request.callback, request.len, false, 0, 0 };
+	send_order.push_back(c);
+	return 0;
+}
+
+void cp210x::set_queue_limits(size_t high_water, size_t low_water) {
+	std::vector<send_completion> ready;
+	bool crossed;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		send_high_water = high_water;
+		send_low_water = std::min(low_water,high_water);
+		crossed = account_send(0,0);
+	}
+	
+	deliver_sends(ready,crossed);
+}
+
+bool cp210x::send_queue_congested() {
+	boost::lock_guard<boost::mutex> lock(send_mutex);
+	return send_congested;
+}
+
+/* ------------------------------------ */
+
+int cp210x::set_coalescing(size_t max_size, uint32_t deadline_us) {
+	if(!handle) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	
+	std::vector<send_completion> ready;
+	bool crossed = false;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		if(max_size) {
+			max_size = std::max<size_t>(max_size / send_max_packet,1) * send_max_packet;
+		} else {
+			flush_batch();
+			crossed = collect_sends(ready);
+		}
+		coalesce_size = max_size;
+		coalesce_deadline_ns = (uint64_t)deadline_us * 1000;
+		
+		if(max_size && !coalesce_thread.joinable()) {
+			coalesce_stop = false;
+			coalesce_thread = boost::thread(boost::bind(&cp210x::coalesce_thread_func,this));
+		}
+	}
+	
+	LOG_DEBUG(cp210x,"coalescing sends up to %zu bytes for %u us",max_size,deadline_us);
+	
+	deliver_sends(ready,crossed);
+	return 0;
+}
+
+int cp210x::coalesce(void *buffer, size_t len, send_callback callback, uint32_t timeout) {
+	std::vector<send_completion> ready;
+	bool crossed;
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		if(send_policy == send_fail && over_high_water(len)) {
+			return LIBUSB_ERROR_BUSY;
+		}
+		
+		if(open_batch && open_batch->data.size() + len > coalesce_size) {
+			flush_batch();
+		}
+		
+		if(!open_batch) {
+			if(batch_free.empty()) {
+				open_batch.reset(new write_batch);
+				open_batch->data.reserve(coalesce_size);
+			} else {
+				open_batch = batch_free.back();
+				batch_free.pop_back();
+			}
+			open_batch->opened_ns = usb::monotonic_ns();
+			open_batch->timeout = timeout;
+			coalesce_cond.notify_one();
+		}
+		
+		const uint8_t *bytes = (const uint8_t*)buffer;
+		open_batch->data.insert(open_batch->data.end(),bytes,bytes + len);
+		open_batch->parts.push_back(std::make_pair(callback,len));
+		open_batch->timeout = std::max(open_batch->timeout,timeout);
+		crossed = account_send(len,0);
+		
+		if(open_batch->data.size() == coalesce_size) {
+			flush_batch();
+		}
+		crossed |= collect_sends(ready);
+	}
 	
-	auto handler = [t,callback](boost::signals2::connection c,usb::transfer *tr) mutable {
-		//fprintf(stderr,"cp210x::send_callback[%p]\n",tr);
-		callback(tr->status(),tr->actual_length());
-		c.disconnect();
-		t.reset();
-	};
+	deliver_sends(ready,crossed);
+	return 0;
+}
+
+// must be called with send_mutex held
+void cp210x::flush_batch() {
+	write_batch_ptr b;
+	b.swap(open_batch);
+	if(!b) {
+		return;
+	}
 	
-	t->transfer_completed.connect_extended(handler);
+	// a transfer ending on a packet boundary needs a ZLP to be seen as
+	// complete by the device before more data arrives
+	send_request request = { b->data.data(), b->data.size(),
+	                         boost::bind(&cp210x::batch_completed,this,b,_1,_2),
+	                         b->timeout, b->opened_ns,
+	                         b->data.size() % send_max_packet == 0, 0 };
+	
+	LOG_TRACE(cp210x,"flushing %zu sends in %zu bytes",b->parts.size(),b->data.size());
+	
+	if(enqueue_send(request,true) < 0) {
+		// fails in order, after the sends submitted before it
+		send_completion c = { request.callback, request.len, true, LIBUSB_TRANSFER_ERROR, 0 };
+		send_order.push_back(c);
+	}
+}
+
+// hands every merged caller its share of actual_length, in order
+void cp210x::batch_completed(write_batch_ptr b, int status, size_t actual_length) {
+	for(auto &part : b->parts) {
+		size_t len = std::min(actual_length,part.second);
+		actual_length -= len;
+		if(part.first) {
+			part.first(status,len);
+		}
+	}
 	
-	return t->submit();
+	boost::lock_guard<boost::mutex> lock(send_mutex);
+	b->data.clear();
+	b->parts.clear();
+	batch_free.push_back(b);
+}
+
+void cp210x::coalesce_thread_func() {
+	boost::unique_lock<boost::mutex> lock(send_mutex);
+	while(!coalesce_stop) {
+		if(!open_batch) {
+			coalesce_cond.wait(lock);
+			continue;
+		}
+		
+		const uint64_t now = usb::monotonic_ns();
+		const uint64_t deadline = open_batch->opened_ns + coalesce_deadline_ns;
+		if(now < deadline) {
+			coalesce_cond.wait_for(lock,boost::chrono::nanoseconds(deadline - now));
+			continue;
+		}
+		
+		flush_batch();
+		
+		std::vector<send_completion> ready;
+		bool crossed = collect_sends(ready);
+		if(crossed || !ready.empty()) {
+			lock.unlock();
+			deliver_sends(ready,crossed);
+			lock.lock();
+		}
+	}
+}
+
+void cp210x::stop_coalescing() {
+	{
+		boost::lock_guard<boost::mutex> lock(send_mutex);
+		coalesce_stop = true;
+		coalesce_cond.notify_one();
+		
+		// merged writes not sent yet fail after the sends before them
+		if(open_batch) {
+			write_batch_ptr b;
+			b.swap(open_batch);
+			send_completion c = { boost::bind(&cp210x::batch_completed,this,b,_1,_2),
+			                      b->data.size(), true, LIBUSB_TRANSFER_CANCELLED, 0 };
+			send_order.push_back(c);
+		}
+	}
+	
+	if(coalesce_thread.joinable()) {
+		coalesce_thread.join();
+	}
+}
+
+void cp210x::set_send_policy(send_policy_t policy) {
+	boost::lock_guard<boost::mutex> lock(send_mutex);
+	send_policy = policy;
+}
+
+usb::histogram_snapshot cp210x::send_wait_snapshot() const {
+	return send_wait.snapshot();
+}
+
+void cp210x::log_stats() const {
+	usb::histogram_snapshot s = send_wait.snapshot();
+	LOG_INFO(cp210x,"send wait: %llu sends, p50 %lluus p99 %lluus p999 %lluus max %lluus",
+	         (unsigned long long)s.count,
+	         (unsigned long long)s.percentile(0.5) / 1000,
+	         (unsigned long long)s.percentile(0.99) / 1000,
+	         (unsigned long long)s.percentile(0.999) / 1000,
+	         (unsigned long long)s.max / 1000);
 }
 
 int cp210x::set_interface_config(uint8_t request, const void *data, size_t len) {
+	// what the device would have answered, a 2 byte value goes in wValue
+	if(shadow_matches(request,data,len)) {
+		return len == sizeof(uint16_t) ? 0 : len;
+	}
+	
+	const void *payload = data;
+	const size_t payload_len = len;
+	
     uint16_t index = 0;
     if(len == sizeof(index)) {
 		index = ((uint16_t*)data)[0];
@@ -267,25 +1095,252 @@ int cp210x::set_interface_config(uint8_t request, const void *data, size_t len)
 		len = 0;
 	}
 	
-	return handle.control_transfer(REQTYPE_HOST_TO_INTERFACE,
-	                               request,
-								   index,
-								   interface_number,
-								   data,
-								   len,
-								   USB_CTRL_SET_TIMEOUT);
+	int ret = handle.control_transfer(REQTYPE_HOST_TO_INTERFACE,
+	                                  request,
+								      index,
+								      interface_number,
+								      data,
+								      len,
+								      USB_CTRL_SET_TIMEOUT);
+	if(ret >= 0) {
+		shadow_store(request,payload,payload_len);
+	}
+	return ret;
 }
 
 int cp210x::get_interface_config(uint8_t request, void *data, size_t len) {
-	return handle.control_transfer(REQTYPE_INTERFACE_TO_HOST,
-	                               request,
-	                               0,
-								   interface_number,
-								   data,
-								   len,
-								   USB_CTRL_GET_TIMEOUT);
+	if(shadow_load(request,data,len)) {
+		return len;
+	}
+	
+	int ret = handle.control_transfer(REQTYPE_INTERFACE_TO_HOST,
+	                                  request,
+	                                  0,
+								      interface_number,
+								      data,
+								      len,
+								      USB_CTRL_GET_TIMEOUT);
+	if(ret == (int)len) {
+		shadow_store(request,data,len);
+	}
+	return ret;
+}
+
+/* ------------------------------------ */
+
+// shadow register backing a get or set request, -1 for uncached requests
+int cp210x::shadow_register(uint8_t request) {
+	switch(request) {
+	case CP210X_GET_BAUDRATE:
+	case CP210X_SET_BAUDRATE: return shadow_baud;
+	case CP210X_GET_LINE_CTL:
+	case CP210X_SET_LINE_CTL: return shadow_ctl;
+	case CP210X_GET_FLOW:
+	case CP210X_SET_FLOW:     return shadow_flow;
+	case CP210X_GET_MDMSTS:
+	case CP210X_SET_MHS:      return shadow_modem;
+	default:                  return -1;
+	}
+}
+
+bool cp210x::shadow_matches(uint8_t request, const void *data, size_t len) {
+	const int reg = shadow_register(request);
+	if(reg < 0 || !data) return false;
+	
+	boost::lock_guard<boost::mutex> lock(shadow_mutex);
+	if(!shadow.valid[reg]) return false;
+	
+	if(request == CP210X_SET_MHS) {
+		// low byte DTR/RTS, high byte which of them to write
+		uint16_t mhs;
+		memcpy(&mhs,data,sizeof(mhs));
+		const uint8_t mask = (mhs >> 8) & (modem_dtr | modem_rts);
+		return (shadow.modem & mask) == (mhs & mask);
+	}
+	
+	switch(reg) {
+	case shadow_baud: return len == sizeof(shadow.baud) && !memcmp(&shadow.baud,data,len);
+	case shadow_ctl:  return len == sizeof(shadow.ctl)  && !memcmp(&shadow.ctl,data,len);
+	case shadow_flow: return len == sizeof(shadow.flow) && !memcmp(&shadow.flow,data,len);
+	default:          return false;
+	}
+}
+
+void cp210x::shadow_store(uint8_t request, const void *data, size_t len) {
+	const int reg = shadow_register(request);
+	if(reg < 0 || !data) return;
+	
+	boost::lock_guard<boost::mutex> lock(shadow_mutex);
+	switch(request) {
+	case CP210X_SET_MHS: {
+		// only the output lines are known after a write
+		if(!shadow.valid[shadow_modem]) return;
+		uint16_t mhs;
+		memcpy(&mhs,data,sizeof(mhs));
+		const uint8_t mask = (mhs >> 8) & (modem_dtr | modem_rts);
+		shadow.modem = (shadow.modem & ~mask) | (mhs & mask);
+		return;
+	}
+	case CP210X_GET_MDMSTS:
+		if(len != sizeof(shadow.modem)) return;
+		memcpy(&shadow.modem,data,len);
+		break;
+	default:
+		switch(reg) {
+		case shadow_baud: if(len != sizeof(shadow.baud)) return; memcpy(&shadow.baud,data,len); break;
+		case shadow_ctl:  if(len != sizeof(shadow.ctl))  return; memcpy(&shadow.ctl,data,len);  break;
+		case shadow_flow: if(len != sizeof(shadow.flow)) return; memcpy(&shadow.flow,data,len); break;
+		}
+	}
+	shadow.valid[reg] = true;
+}
+
+bool cp210x::shadow_load(uint8_t request, void *data, size_t len) {
+	const int reg = shadow_register(request);
+	if(reg < 0) return false;
+	
+	boost::lock_guard<boost::mutex> lock(shadow_mutex);
+	if(!shadow.valid[reg]) return false;
+	
+	switch(reg) {
+	case shadow_baud:  if(len != sizeof(shadow.baud))  return false; memcpy(data,&shadow.baud,len);  break;
+	case shadow_ctl:   if(len != sizeof(shadow.ctl))   return false; memcpy(data,&shadow.ctl,len);   break;
+	case shadow_flow:  if(len != sizeof(shadow.flow))  return false; memcpy(data,&shadow.flow,len);  break;
+	case shadow_modem: if(len != sizeof(shadow.modem)) return false; memcpy(data,&shadow.modem,len); break;
+	}
+	return true;
+}
+
+void cp210x::invalidate_shadow() {
+	boost::lock_guard<boost::mutex> lock(shadow_mutex);
+	for(auto &valid : shadow.valid) {
+		valid = false;
+	}
 }
 
+/* ------------------------------------ */
+
+void cp210x::control_completed(usb::transfer *tr, control_callback callback) {
+	{
+		// completions are serialized on the event thread, so everything
+		// parked earlier has left its transfer_completed emission
+		boost::lock_guard<boost::mutex> lock(control_mutex);
+		control_done.clear();
+	}
+	
+	LOG_TRACE(cp210x,"control transfer completed status[%s] length[%i]",
+	          tr->status_str(),tr->actual_length());
+	
+	if(callback) {
+		callback(tr->status(),tr->control_data(),std::max(tr->actual_length(),0));
+	}
+	
+	boost::lock_guard<boost::mutex> lock(control_mutex);
+	for(auto it = control_active.begin(); it != control_active.end(); ++it) {
+		if(it->get() == tr) {
+			control_done.splice(control_done.end(),control_active,it);
+			break;
+		}
+	}
+}
+
+int cp210x::control_async(uint8_t bmRequestType, uint8_t bRequest,
+                          uint16_t wValue, uint16_t wIndex,
+                          const void *data, uint16_t wLength,
+                          control_callback callback)
+{
+	if(!handle) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	
+	const unsigned int timeout = (bmRequestType & LIBUSB_ENDPOINT_IN) ?
+	                             USB_CTRL_GET_TIMEOUT : USB_CTRL_SET_TIMEOUT;
+	boost::shared_ptr<usb::transfer> tr(new usb::transfer(handle,LIBUSB_TRANSFER_TYPE_CONTROL,
+	                                                      0,0,timeout));
+	tr->fill_control(bmRequestType,bRequest,wValue,wIndex,data,wLength);
+	tr->transfer_completed.connect(boost::bind(&cp210x::control_completed,this,_1,callback));
+	
+	boost::lock_guard<boost::mutex> lock(control_mutex);
+	control_active.push_back(tr);
+	
+	int result = tr->submit();
+	if(result < 0) {
+		LOG_WARNING(cp210x,"Cannot submit control request 0x%02hhX: %s",
+		            bRequest,libusb_error_name(result));
+		control_active.pop_back();
+	}
+	return result;
+}
+
+static void config_completed(cp210x::config_callback callback,
+                             int status, const uint8_t *, size_t)
+{
+	if(callback) {
+		callback(status);
+	}
+}
+
+void cp210x::config_stored(uint8_t request, std::vector<uint8_t> value,
+                           config_callback callback, int status)
+{
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		shadow_store(request,value.data(),value.size());
+	}
+	if(callback) {
+		callback(status);
+	}
+}
+
+void cp210x::config_loaded(uint8_t request, control_callback callback,
+                           int status, const uint8_t *data, size_t len)
+{
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		shadow_store(request,data,len);
+	}
+	if(callback) {
+		callback(status,data,len);
+	}
+}
+
+// unchanged registers complete right away without a transfer
+int cp210x::set_interface_config_async(uint8_t request, const void *data, size_t len,
+                                       config_callback callback)
+{
+	if(shadow_matches(request,data,len)) {
+		if(callback) callback(LIBUSB_TRANSFER_COMPLETED);
+		return 0;
+	}
+	
+	std::vector<uint8_t> value;
+	if(data) {
+		value.assign((const uint8_t*)data,(const uint8_t*)data + len);
+	}
+	config_callback stored = boost::bind(&cp210x::config_stored,this,request,value,callback,_1);
+	
+	uint16_t index = 0;
+	if(len == sizeof(index)) {
+		index = ((uint16_t*)data)[0];
+		data = 0;
+		len = 0;
+	}
+	
+	return control_async(REQTYPE_HOST_TO_INTERFACE,request,index,interface_number,
+	                     data,len,boost::bind(config_completed,stored,_1,_2,_3));
+}
+
+int cp210x::get_interface_config_async(uint8_t request, size_t len, control_callback callback) {
+	std::vector<uint8_t> cached(len);
+	if(shadow_load(request,cached.data(),len)) {
+		if(callback) callback(LIBUSB_TRANSFER_COMPLETED,cached.data(),len);
+		return 0;
+	}
+	
+	return control_async(REQTYPE_INTERFACE_TO_HOST,request,0,interface_number,
+	                     0,len,boost::bind(&cp210x::config_loaded,this,request,callback,_1,_2,_3));
+}
+
+/* ------------------------------------ */
+
 int cp210x::set_interface_config_single(uint8_t request, unsigned int data) {
 	return set_interface_config(request, &data, 2);
 }
@@ -300,14 +1355,17 @@ int cp210x::get_device_config(uint16_t value, uint16_t index,void *data, size_t
 	                               value,index,data,len,USB_CTRL_GET_TIMEOUT);
 }
 
-int cp210x::set_config_string(uint16_t value, size_t max_length, char* data) {
+// string descriptor layout: bLength, bDescriptorType, UTF-16LE text
+int cp210x::encode_config_string(size_t max_length, const char *data,
+                                 boost::shared_array<char> &buffer)
+{
 	conv cd("UTF-16LE","UTF8");
 	if(!cd) return -1;
 	
-	boost::shared_array<char> buffer(new char[max_length + 2]);
+	buffer.reset(new char[max_length + 2]);
 	size_t outbytesleft = max_length;
 	size_t inbytesleft = strlen(data);
-	if((size_t)-1 == cd.convert(data,&inbytesleft,buffer.get() + 2,&outbytesleft)) {
+	if((size_t)-1 == cd.convert((char*)data,&inbytesleft,buffer.get() + 2,&outbytesleft)) {
 		return -1;
 	}
 	
@@ -315,13 +1373,32 @@ int cp210x::set_config_string(uint16_t value, size_t max_length, char* data) {
 	buffer[0] = length + 2;
 	buffer[1] = 3;
 	
-	return set_device_config(value,interface_number,buffer.get(),length + 2);
+	return length + 2;
+}
+
+int cp210x::set_config_string(uint16_t value, size_t max_length, char* data) {
+	boost::shared_array<char> buffer;
+	int length = encode_config_string(max_length,data,buffer);
+	if(length < 0) return -1;
+	
+	return set_device_config(value,interface_number,buffer.get(),length);
 }
 
 int cp210x::set_product_string(char* s) {
 	return set_config_string(REG_PRODUCT_STRING,SIZE_PRODUCT_STRING,s);
 }
 
+int cp210x::set_product_string_async(const char *s, config_callback callback) {
+	boost::shared_array<char> buffer;
+	int length = encode_config_string(SIZE_PRODUCT_STRING,s,buffer);
+	if(length < 0) return -1;
+	
+	// fill_control copies the payload, buffer may go away on return
+	return control_async(REQTYPE_HOST_TO_DEVICE,CP2101_CONFIG,
+	                     REG_PRODUCT_STRING,interface_number,buffer.get(),length,
+	                     boost::bind(config_completed,callback,_1,_2,_3));
+}
+
 int cp210x::get_product_string(char *s, size_t len) {
 	usb::config_descriptor desc(device);
 	
@@ -339,5 +1416,5 @@ int cp210x::get_product_string(char *s, size_t len) {
 }
 
 cp210x::operator bool() const {
-	return handle;
+	return handle || player;
 }
\ No newline at end of file
@@ -0,0 +1,274 @@
+#include <cp210x_manager.h>
+#include <log.h>
+
+#include <set>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <boost/bind.hpp>
+#include <boost/thread/lock_guard.hpp>
+
+cp210x_manager::cp210x_manager(const usb::context &ctx, bool _auto_recv,
+                               size_t _recv_depth, size_t _recv_packets,
+                               size_t _send_depth, int _event_cpu)
+:context(ctx),
+ auto_recv(_auto_recv),
+ recv_depth(_recv_depth),
+ recv_packets(_recv_packets),
+ send_depth(_send_depth),
+ completed(0),
+ event_cpu(_event_cpu),
+ hotplug(new hotplug_state) {
+	event_thread = boost::thread(boost::bind(&cp210x_manager::event_thread_func,this));
+}
+
+cp210x_manager::~cp210x_manager() {
+	arrived_connection.disconnect();
+	left_connection.disconnect();
+	
+	{
+		// adapters reap their own cancellations, the event thread may
+		// still be running alongside
+		boost::lock_guard<boost::mutex> lock(mutex);
+		adapters.clear();
+	}
+	
+	completed = 1;
+	if(event_thread.joinable()) {
+		event_thread.join();
+	}
+}
+
+void cp210x_manager::event_thread_func() {
+	if(event_cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(event_cpu,&cpus);
+		if(int ret = pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus)) {
+			LOG_WARNING(cp210x,"Cannot pin usb event thread to cpu %i: %s",event_cpu,strerror(ret));
+		}
+	}
+	
+	while(!completed) {
+		struct timeval tv = { 1, 0 };
+		libusb_handle_events_timeout_completed(context,&tv,&completed);
+		
+		// hotplug callbacks ran inside the call above, adapters are
+		// opened right after it returns
+		if(!completed) {
+			hotplug_changed();
+		}
+	}
+	
+	LOG_DEBUG(cp210x,"manager event thread completed");
+}
+
+// must be called with mutex held
+bool cp210x_manager::is_open(const std::string &path) {
+	for(auto &a : adapters) {
+		if(a.path == path) return true;
+	}
+	return false;
+}
+
+// must be called with mutex held
+cp210x_manager::pointer cp210x_manager::open(const usb::device &dev,
+                                             const std::string &path,
+                                             const std::string &serial)
+{
+	pointer cp(new cp210x(context,dev,auto_recv,recv_depth,recv_packets,send_depth,
+	                      cp210x::events_external));
+	if(!*cp) {
+		LOG_ERROR(cp210x,"Cannot open cp210x at %s",path.c_str());
+		return pointer();
+	}
+	
+	LOG_INFO(cp210x,"Opened cp210x at %s serial [%s]",path.c_str(),serial.c_str());
+	
+	adapter a = { cp, path, serial, dev };
+	adapters.push_back(a);
+	return cp;
+}
+
+size_t cp210x_manager::open_all() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	
+	size_t opened = 0;
+	for(auto &dev : cp210x::find_devices(context)) {
+		const std::string path = dev.port_path();
+		if(is_open(path)) continue;
+		
+		if(open(dev,path,dev.read_serial())) {
+			opened++;
+		}
+	}
+	return opened;
+}
+
+cp210x_manager::pointer cp210x_manager::open_serial(const std::string &serial) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	
+	for(auto &a : adapters) {
+		if(a.serial == serial) return a.cp;
+	}
+	
+	for(auto &dev : cp210x::find_devices(context)) {
+		const std::string path = dev.port_path();
+		if(is_open(path)) continue;
+		
+		if(dev.read_serial() == serial) {
+			return open(dev,path,serial);
+		}
+	}
+	
+	LOG_WARNING(cp210x,"No cp210x with serial [%s]",serial.c_str());
+	return pointer();
+}
+
+cp210x_manager::pointer cp210x_manager::open_path(const std::string &path) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	
+	for(auto &a : adapters) {
+		if(a.path == path) return a.cp;
+	}
+	
+	for(auto &dev : cp210x::find_devices(context)) {
+		if(dev.port_path() == path) {
+			return open(dev,path,dev.read_serial());
+		}
+	}
+	
+	LOG_WARNING(cp210x,"No cp210x at %s",path.c_str());
+	return pointer();
+}
+
+size_t cp210x_manager::open_spec(const std::string &spec) {
+	size_t opened = 0;
+	
+	size_t begin = 0;
+	while(begin <= spec.size()) {
+		size_t end = spec.find(',',begin);
+		if(end == std::string::npos) end = spec.size();
+		const std::string item = spec.substr(begin,end - begin);
+		begin = end + 1;
+		
+		if(item.empty()) {
+			continue;
+		} else if(item == "all") {
+			opened += open_all();
+		} else if(item.compare(0,7,"serial:") == 0) {
+			opened += open_serial(item.substr(7)) ? 1 : 0;
+		} else if(item.compare(0,5,"path:") == 0) {
+			opened += open_path(item.substr(5)) ? 1 : 0;
+		} else {
+			LOG_WARNING(cp210x,"Ignoring adapter selection [%s]",item.c_str());
+		}
+	}
+	return opened;
+}
+
+size_t cp210x_manager::watch(const std::string &spec) {
+	usb::device_registry *registry = context.registry();
+	if(!registry) {
+		LOG_WARNING(cp210x,"Cannot watch for adapters without hotplug, opening them once");
+		return open_spec(spec);
+	}
+	
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		watch_spec = spec;
+	}
+	
+	// the slots hold the flags, not the manager, they may still be
+	// running on another thread while it is destroyed
+	boost::shared_ptr<hotplug_state> state = hotplug;
+	arrived_connection = registry->device_arrived.connect([state](usb::device dev) {
+		if(cp210x::is_adapter(dev)) {
+			state->arrived = true;
+		}
+	});
+	left_connection = registry->device_left.connect([state](usb::device) {
+		state->left = true;
+	});
+	
+	return open_spec(spec);
+}
+
+void cp210x_manager::hotplug_changed() {
+	if(hotplug->left.exchange(false)) {
+		std::set<libusb_device*> present;
+		for(auto &dev : cp210x::find_devices(context)) {
+			present.insert(dev);
+		}
+		
+		std::vector<adapter> gone;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			for(auto i = adapters.begin(); i != adapters.end(); ) {
+				if(!present.count(i->dev)) {
+					gone.push_back(*i);
+					i = adapters.erase(i);
+				} else {
+					++i;
+				}
+			}
+		}
+		
+		// the last reference reaps its transfers here, outside the
+		// hotplug callback
+		for(auto &a : gone) {
+			LOG_INFO(cp210x,"cp210x at %s left",a.path.c_str());
+			adapter_closed(a);
+		}
+	}
+	
+	if(hotplug->arrived.exchange(false)) {
+		std::string spec;
+		std::set<std::string> before;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			spec = watch_spec;
+			for(auto &a : adapters) {
+				before.insert(a.path);
+			}
+		}
+		if(spec.empty() || !open_spec(spec)) return;
+		
+		std::vector<adapter> opened;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			for(auto &a : adapters) {
+				if(!before.count(a.path)) opened.push_back(a);
+			}
+		}
+		for(auto &a : opened) {
+			adapter_opened(a);
+		}
+	}
+}
+
+size_t cp210x_manager::size() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	return adapters.size();
+}
+
+cp210x_manager::adapter cp210x_manager::get(size_t i) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	return adapters.at(i);
+}
+
+cp210x_manager::pointer cp210x_manager::find_serial(const std::string &serial) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	for(auto &a : adapters) {
+		if(a.serial == serial) return a.cp;
+	}
+	return pointer();
+}
+
+cp210x_manager::pointer cp210x_manager::find_path(const std::string &path) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	for(auto &a : adapters) {
+		if(a.path == path) return a.cp;
+	}
+	return pointer();
+}
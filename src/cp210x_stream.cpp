@@ -1,13 +1,13 @@
 #include <cp210x_stream.h>
 
-#include <iostream>
+#include <log.h>
 
 cp210x_stream::cp210x_stream(sender_t _sender, uint32_t _index):sender(_sender) {
 	
 }
 
 cp210x_stream::~cp210x_stream() {
-	std::cerr << "~data_stream" << std::endl;
+	LOG_TRACE(stream,"~data_stream");
 }
 
 int cp210x_stream::send(void *data, size_t len, base_stream::send_callback callback) {
@@ -3,13 +3,28 @@
 #include <cp210x.h>
 #include <cp210x_stream.h>
 
-#include <iostream>
+#include <log.h>
 #include <boost/make_shared.hpp>
 
-dispatcher::dispatcher(usb::context &_context,boost::asio::io_service &io_svc)
-:context(_context),cp(context,true) {
+dispatcher::dispatcher(usb::context &_context,boost::asio::io_service &io_svc,
+                       const char *replay_path, bool realtime, bool asio, bool framed)
+:context(_context),
+ cp(context,true,4,1,8,asio ? cp210x::events_external : cp210x::events_thread) {
+	bool replaying = false;
+	if(replay_path) {
+		replaying = cp.replay(replay_path,realtime) == 0;
+		if(!replaying && cp) {
+			LOG_WARNING(app,"replay of %s failed, serving the attached device",replay_path);
+		}
+	}
+	
 	if(!cp) return;
 	
+	// a live device needs its libusb events handled, a replay has none
+	if(asio && !replaying) {
+		events.reset(new usb::asio_events(context,io_svc));
+	}
+	
 //	cp.set_baud(38400);
 //	cp.set_ctl(cp210x::data8 | cp210x::parity_even | cp210x::stop1);
 	
@@ -20,23 +35,48 @@ dispatcher::dispatcher(usb::context &_context,boost::asio::io_service &io_svc)
 		return this->cp.send_async(data,len,cb);		
 	};
 		
-	for(uint32_t i = 0; i < 6; i++) {
-		streams.push_back(boost::make_shared<cp210x_stream>(sender,i));
+	if(framed) {
+		mux.reset(new dmx_mux([sender](size_t, void *data, size_t len, base_stream::send_callback cb) {
+			return sender(data,len,cb);
+		},6,&io_svc));
+		for(size_t i = 0; i < mux->size(); i++) {
+			streams.push_back(mux->get_stream(i));
+		}
+	} else {
+		for(uint32_t i = 0; i < 6; i++) {
+			streams.push_back(boost::make_shared<cp210x_stream>(sender,i));
+		}
 	}
 		
-	connection = cp.data_received.connect([this](int status, void *data, size_t len) {
-		return this->dispatch(status,data,len);
+	connection = cp.buffer_received.connect([this](int status, shared_buffer buffer) {
+		return this->dispatch(status,buffer);
 	});
+	
+	// dmx streams bound what they queue with their own window and
+	// backpressure, raw streams follow the cp210x send queue
+	if(!mux) {
+		backpressure_connection = cp.send_backpressure.connect([this](bool congested) {
+			for(auto &stream : this->streams) {
+				stream->set_congested(congested);
+			}
+		});
+	}
 }
 
 dispatcher::~dispatcher() {
-	std::cerr << "~dispatcher" << std::endl;
+	LOG_DEBUG(app,"~dispatcher");
 	connection.disconnect();
+	backpressure_connection.disconnect();
+	events.reset();
 }
 
-void dispatcher::dispatch(int status, void *data, size_t len) {
-	if(!status) {
-		streams[0]->data_received(data,len);
+void dispatcher::dispatch(int status, shared_buffer buffer) {
+	if(status) return;
+	
+	if(mux) {
+		mux->dispatch(buffer);
+	} else {
+		streams[0]->deliver(buffer);
 	}
 }
 
@@ -44,6 +84,18 @@ boost::shared_ptr<base_stream> dispatcher::get_stream(size_t i) {
 	return streams[i];
 }
 
+int dispatcher::set_coalescing(size_t max_size, uint32_t deadline_us) {
+	return cp.set_coalescing(max_size,deadline_us);
+}
+
+void dispatcher::log_stats() const {
+	usb::transfer_stats::instance().log();
+	cp.log_stats();
+	if(mux) {
+		mux->log_stats();
+	}
+}
+
 dispatcher::operator bool() const {
 	return cp;
 }
\ No newline at end of file
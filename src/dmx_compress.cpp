@@ -0,0 +1,170 @@
+#include <dmx_compress.h>
+
+#include <string.h>
+#include <algorithm>
+
+#define DMX_HISTORY_MASK (DMX_HISTORY - 1)
+
+static inline uint32_t prefix_hash(const uint8_t *p) {
+	const uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return (v * 2654435761u) >> (32 - DMX_HASH_BITS);
+}
+
+/* ------------------------------------ */
+
+dmx_encoder::dmx_encoder():pos(0),restart(true) {
+	memset(history,0,sizeof(history));
+	memset(head,0,sizeof(head));
+}
+
+void dmx_encoder::reset() {
+	memset(head,0,sizeof(head));
+	pos = 0;
+	restart = true;
+}
+
+void dmx_encoder::absorb(const uint8_t *data, size_t len, size_t i) {
+	if(i + DMX_MATCH_MIN <= len) {
+		head[prefix_hash(data + i)] = pos + 1;
+	}
+	history[pos & DMX_HISTORY_MASK] = data[i];
+	pos++;
+}
+
+size_t dmx_encoder::encode(const uint8_t *data, size_t len, uint8_t *out, size_t capacity, size_t &consumed) {
+	consumed = 0;
+	if(capacity < 2 || !len) return 0;
+
+	out[0] = DMX_CODEC_LZ;
+	size_t o = 1;
+	size_t i = 0;
+	// index in out of the open literal run's length byte, 0 when none
+	size_t run = 0;
+
+	while(i < len) {
+		size_t best = 0;
+		uint32_t dist = 0;
+
+		if(len - i >= DMX_MATCH_MIN) {
+			const uint32_t cand = head[prefix_hash(data + i)];
+			dist = cand ? pos - (cand - 1) : 0;
+			if(dist >= 1 && dist <= DMX_HISTORY) {
+				const size_t limit = std::min<size_t>(DMX_MATCH_MAX,len - i);
+				const uint32_t start = pos - dist;
+				// bytes before pos come from the history, later ones
+				// overlap the input being coded
+				while(best < limit) {
+					const uint8_t src = best < dist ? history[(start + best) & DMX_HISTORY_MASK]
+					                                : data[i + best - dist];
+					if(src != data[i + best]) break;
+					best++;
+				}
+			}
+		}
+
+		if(best >= DMX_MATCH_MIN) {
+			if(o + 2 > capacity) break;
+			out[o++] = 0x80 | ((best - DMX_MATCH_MIN) << 2) | ((dist - 1) >> 8);
+			out[o++] = (dist - 1) & 0xff;
+			run = 0;
+			for(size_t k = 0; k < best; k++) {
+				absorb(data,len,i++);
+			}
+		} else {
+			if(!run || out[run] == 0x7f) {
+				if(o + 2 > capacity) break;
+				run = o;
+				out[o++] = 0;
+			} else {
+				if(o + 1 > capacity) break;
+				out[run]++;
+			}
+			out[o++] = data[i];
+			absorb(data,len,i++);
+		}
+	}
+
+	const uint8_t flags = restart ? DMX_CODEC_RESET : 0;
+	restart = false;
+	
+	// coded bytes are in the history already, a raw frame adds the rest
+	const size_t raw = std::min(len,capacity - 1);
+	if(i > raw || (i == raw && o < raw + 1)) {
+		out[0] |= flags;
+		consumed = i;
+		return o;
+	}
+
+	out[0] = DMX_CODEC_RAW | flags;
+	memcpy(out + 1,data,raw);
+	for(size_t k = i; k < raw; k++) {
+		absorb(data,len,k);
+	}
+	consumed = raw;
+	return raw + 1;
+}
+
+/* ------------------------------------ */
+
+dmx_decoder::dmx_decoder():pos(0),lost(false) {
+	memset(history,0,sizeof(history));
+}
+
+void dmx_decoder::lose() {
+	lost = true;
+}
+
+int dmx_decoder::fail() {
+	lost = true;
+	return -1;
+}
+
+int dmx_decoder::decode(const uint8_t *in, size_t len, uint8_t *out, size_t capacity) {
+	if(!len) return fail();
+	
+	if(in[0] & DMX_CODEC_RESET) {
+		// matches cannot reach further back than pos
+		pos = 0;
+		lost = false;
+	} else if(lost) {
+		return -1;
+	}
+	
+	const uint8_t codec = in[0] & ~DMX_CODEC_RESET;
+	size_t o = 0;
+	if(codec == DMX_CODEC_RAW) {
+		if(len - 1 > capacity) return fail();
+		memcpy(out,in + 1,len - 1);
+		o = len - 1;
+	} else if(codec == DMX_CODEC_LZ) {
+		size_t i = 1;
+		while(i < len) {
+			const uint8_t token = in[i++];
+			if(!(token & 0x80)) {
+				const size_t count = token + 1;
+				if(i + count > len || o + count > capacity) return fail();
+				memcpy(out + o,in + i,count);
+				i += count;
+				o += count;
+			} else {
+				if(i >= len) return fail();
+				const size_t count = ((token >> 2) & 0x1f) + DMX_MATCH_MIN;
+				const uint32_t dist = (((token & 3) << 8) | in[i++]) + 1;
+				if(dist > std::min<size_t>(pos + o,DMX_HISTORY) || o + count > capacity) return fail();
+				// the history holds what came before this payload, the
+				// rest is in out already
+				for(size_t k = 0; k < count; k++, o++) {
+					out[o] = dist <= o ? out[o - dist] : history[(pos + o - dist) & DMX_HISTORY_MASK];
+				}
+			}
+		}
+	} else {
+		return fail();
+	}
+	
+	for(size_t k = 0; k < o; k++) {
+		history[(pos + k) & DMX_HISTORY_MASK] = out[k];
+	}
+	pos += o;
+	return o;
+}
@@ -0,0 +1,646 @@
+#include <dmx_link.h>
+
+#include <log.h>
+#include <usb_trace.h>
+#include <string.h>
+#include <boost/bind.hpp>
+
+// control frame types, first payload byte on address 0
+#define DMX_LINK_HELLO     0x01
+#define DMX_LINK_HELLO_ACK 0x02
+#define DMX_LINK_ACK       0x06
+#define DMX_LINK_SKIP      0x0B
+#define DMX_LINK_SKIP_ACK  0x0C
+#define DMX_LINK_NAK       0x15
+
+// type and three argument bytes
+#define DMX_LINK_CONTROL_SIZE (DMX_LINK_OVERHEAD + 4)
+
+#define DMX_LINK_TICK_MS   20
+#define DMX_LINK_HELLO_MS  200
+#define DMX_LINK_HELLOS    5
+
+/* ------------------------------------ */
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF
+static const uint16_t* crc16_table() {
+	static struct table_t {
+		uint16_t entries[256];
+
+		table_t() {
+			for(unsigned i = 0; i < 256; i++) {
+				uint16_t crc = i << 8;
+				for(int bit = 0; bit < 8; bit++) {
+					crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+				}
+				entries[i] = crc;
+			}
+		}
+	} table;
+	return table.entries;
+}
+
+uint16_t dmx_link::crc16(const uint8_t *data, size_t len) {
+	const uint16_t *table = crc16_table();
+	uint16_t crc = 0xFFFF;
+	for(size_t i = 0; i < len; i++) {
+		crc = (crc << 8) ^ table[(crc >> 8) ^ data[i]];
+	}
+	return crc;
+}
+
+/* ------------------------------------ */
+
+dmx_link::dmx_link(boost::asio::io_service &io_svc, sender_t _lower, deliver_t _deliver, lost_t _lost,
+                   size_t _channels)
+:lower(_lower),deliver(_deliver),lost(_lost),channels(_channels),ticker(io_svc),ticking(false),
+ frame_pool(buffer_pool::create(DMX_LINK_MAX_PAYLOAD + DMX_LINK_OVERHEAD,16)),
+ current(state_plain),hellos(0),hello_ns(0),was_active(false),
+ // differs between runs, so that the peer can tell a restart
+ local_epoch(usb::monotonic_ns() ^ (usb::monotonic_ns() >> 16)),peer_epoch(0),
+ line_rate(0),write_bytes(0),unacked(0),attempts(0),tx(_channels),rx(_channels),
+ payload_pool(buffer_pool::create(DMX_LINK_MAX_PAYLOAD,4)),restarted(false),
+ bad_headers(0),crc_errors(0),retransmits(0),failed(0),naks_sent(0),duplicates(0),
+ out_of_window(0),skips(0)
+{
+	for(auto &t : tx) {
+		t.next_seq = 0;
+		t.skipping = false;
+		t.required = false;
+		for(auto &e : t.window) {
+			e.used = false;
+		}
+	}
+	for(auto &r : rx) {
+		r.expected = 0;
+		r.nak_sent = false;
+	}
+	carry.reserve(2 * (DMX_LINK_MAX_PAYLOAD + DMX_LINK_OVERHEAD));
+}
+
+dmx_link::~dmx_link() {
+	LOG_TRACE(dmx,"~dmx_link");
+	// a pending tick finds the link gone and does not rearm
+	ticker.cancel();
+}
+
+void dmx_link::negotiate() {
+	boost::unique_lock<boost::mutex> lock(mutex);
+	if(!ticking) {
+		ticking = true;
+		start_tick();
+	}
+	start_negotiation();
+	run_collected(lock);
+}
+
+dmx_link::state_t dmx_link::state() const {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	return current;
+}
+
+void dmx_link::set_line_rate(size_t bytes_per_second, size_t _write_bytes) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	line_rate = bytes_per_second;
+	write_bytes = _write_bytes;
+}
+
+void dmx_link::require(size_t channel) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(channel < channels) {
+		tx[channel].required = true;
+	}
+}
+
+void dmx_link::start_tick() {
+	// the tick holds the link only while it runs, the last owner may
+	// drop it on another thread meanwhile
+	boost::weak_ptr<dmx_link> self = shared_from_this();
+	ticker.expires_from_now(boost::posix_time::milliseconds(DMX_LINK_TICK_MS));
+	ticker.async_wait([self](const boost::system::error_code &error) {
+		if(boost::shared_ptr<dmx_link> link = self.lock()) {
+			link->tick(error);
+		}
+	});
+}
+
+// hello and retransmission timeouts
+void dmx_link::tick(const boost::system::error_code &error) {
+	if(error) return;
+
+	boost::unique_lock<boost::mutex> lock(mutex);
+	start_tick();
+	const uint64_t now = usb::monotonic_ns();
+
+	if(current == state_negotiating && now - hello_ns >= DMX_LINK_HELLO_MS * 1000000ull) {
+		if(hellos >= DMX_LINK_HELLOS && !was_active) {
+			LOG_WARNING(dmx,"no link layer answer, using plain frames");
+			resolve(state_plain);
+		} else {
+			hellos++;
+			hello_ns = now;
+			send_hello(DMX_LINK_HELLO);
+		}
+	}
+
+	const uint64_t timeout = timeout_ns();
+	for(size_t channel = 0; channel < channels && current == state_active; channel++) {
+		tx_channel &t = tx[channel];
+		for(auto &e : t.window) {
+			// the timeout only runs once the lower layer wrote the frame
+			if(!e.used || e.queued || now - e.sent_ns < timeout) continue;
+
+			if(e.retries >= DMX_LINK_RETRIES) {
+				give_up(channel);
+				break;
+			}
+			e.retries++;
+			retransmits.fetch_add(1,std::memory_order_relaxed);
+			transmit(channel,e);
+		}
+
+		if(t.skipping && now - t.skip_ns >= timeout) {
+			if(t.skip_retries >= DMX_LINK_RETRIES) {
+				LOG_WARNING(dmx,"channel %zu: skip not acknowledged, negotiating again",channel + 1);
+				start_negotiation();
+			} else {
+				t.skip_retries++;
+				send_skip(channel);
+			}
+		}
+	}
+
+	run_collected(lock);
+}
+
+// the retransmission timeout, counted from the end of the write: the
+// frame still drains from the UART, and the answer may queue behind a
+// write of the peer and the answers to everything else in flight
+uint64_t dmx_link::timeout_ns() const {
+	uint64_t ns = DMX_LINK_RTO_MS * 1000000ull;
+	if(line_rate) {
+		const size_t bytes = 2 * write_bytes + unacked * DMX_LINK_CONTROL_SIZE;
+		ns += bytes * 1000000000ull / line_rate;
+	}
+	return ns;
+}
+
+void dmx_link::written(size_t channel, uint8_t seq, uint32_t attempt, int status) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+
+	tx_entry &e = tx[channel].window[seq % DMX_LINK_MAX_WINDOW];
+	if(!e.used || e.seq != seq || e.attempt != attempt) return;
+
+	// a failed write is sent again once the timeout ran out
+	if(status) {
+		LOG_DEBUG(dmx,"channel %zu seq %i: write failed: %i",channel + 1,(int)seq,status);
+	}
+	e.queued = false;
+	e.sent_ns = usb::monotonic_ns();
+}
+
+void dmx_link::run_collected(boost::unique_lock<boost::mutex> &lock) {
+	const bool restart = restarted;
+	std::vector<pending_write> out;
+	std::vector<arrival> in;
+	std::vector<completion> done;
+	std::deque<held_send> flush;
+	restarted = false;
+	out.swap(writes);
+	in.swap(arrivals);
+	done.swap(completed);
+	flush.swap(released);
+	lock.unlock();
+
+	// before anything is written or delivered on the new numbering
+	if(restart) {
+		lost(0);
+	}
+
+	boost::weak_ptr<dmx_link> self;
+	for(auto &w : out) {
+		shared_buffer frame = w.frame;
+		if(!w.attempt) {
+			// control frames are not acknowledged, the write only has
+			// to keep the frame alive
+			int ret = lower(w.channel,frame.data(),frame.size(),[frame](int, size_t) {});
+			if(ret < 0) {
+				LOG_WARNING(dmx,"link control send failed: %i",ret);
+			}
+			continue;
+		}
+
+		if(self.expired()) self = shared_from_this();
+		const size_t channel = w.channel;
+		const uint8_t seq = w.seq;
+		const uint32_t attempt = w.attempt;
+		int ret = lower(channel,frame.data(),frame.size(),[self,channel,seq,attempt,frame](int status, size_t) {
+			if(boost::shared_ptr<dmx_link> link = self.lock()) {
+				link->written(channel,seq,attempt,status);
+			}
+		});
+		if(ret < 0) {
+			LOG_WARNING(dmx,"link send on channel %zu failed: %i",channel + 1,ret);
+			written(channel,seq,attempt,ret);
+		}
+	}
+
+	for(auto &a : in) {
+		if(a.lost) {
+			lost(a.addr);
+		} else {
+			deliver(a.addr,a.payload);
+		}
+	}
+	for(auto &c : done) {
+		c.first(c.second,0);
+	}
+	for(auto &h : flush) {
+		int ret = send(h.channel,h.frame,h.len,h.callback);
+		if(ret < 0) {
+			h.callback(ret,0);
+		}
+	}
+}
+
+void dmx_link::resolve(state_t state) {
+	current = state;
+	if(state == state_active) {
+		LOG_INFO(dmx,"link layer active, epoch %u, peer epoch %u",local_epoch,peer_epoch);
+		was_active = true;
+	}
+	released.insert(released.end(),held.begin(),held.end());
+	held.clear();
+}
+
+void dmx_link::start_negotiation() {
+	LOG_INFO(dmx,"negotiating link layer");
+	if(++local_epoch == 0) local_epoch = 1;
+	peer_epoch = 0;
+	reset();
+
+	current = state_negotiating;
+	hellos = 1;
+	hello_ns = usb::monotonic_ns();
+	send_hello(DMX_LINK_HELLO);
+}
+
+// numbering starts over on both ends, everything in flight is lost
+void dmx_link::reset() {
+	for(auto &t : tx) {
+		t.next_seq = 0;
+		t.skipping = false;
+		for(auto &e : t.window) {
+			if(!e.used) continue;
+			completed.push_back(completion(e.callback,-1));
+			e.used = false;
+			e.frame = shared_buffer();
+		}
+	}
+	unacked = 0;
+
+	for(auto &r : rx) {
+		r.expected = 0;
+		r.nak_sent = false;
+		for(auto &h : r.held) {
+			h = shared_buffer();
+		}
+	}
+	restarted = true;
+}
+
+// fails every frame in flight on channel and has the receiver skip them,
+// a later frame may depend on a failed one (see dmx_compress)
+void dmx_link::give_up(size_t channel) {
+	tx_channel &t = tx[channel];
+	size_t count = 0;
+	for(auto &e : t.window) {
+		if(!e.used) continue;
+		completed.push_back(completion(e.callback,-1));
+		e.used = false;
+		e.frame = shared_buffer();
+		unacked--;
+		count++;
+	}
+	failed.fetch_add(count,std::memory_order_relaxed);
+	LOG_WARNING(dmx,"channel %zu: frames before seq %i not acknowledged, giving up %zu",
+	            channel + 1,(int)t.next_seq,count);
+
+	t.skipping = true;
+	t.skip_to = t.next_seq;
+	t.skip_retries = 0;
+	send_skip(channel);
+}
+
+/* ------------------------------------ */
+
+int dmx_link::send(size_t channel, void *frame, size_t len, base_stream::send_callback callback) {
+	boost::unique_lock<boost::mutex> lock(mutex);
+
+	if(channel >= channels) {
+		return -1;
+	}
+
+	if(current == state_negotiating) {
+		held_send h = { channel, frame, len, callback };
+		held.push_back(h);
+		return 0;
+	}
+
+	if(current == state_plain) {
+		if(tx[channel].required) {
+			return -1;
+		}
+		lock.unlock();
+		return lower(channel,frame,len,callback);
+	}
+
+	const uint8_t *plain = (const uint8_t*)frame;
+	if(len < 2 || plain[1] > DMX_LINK_MAX_PAYLOAD || plain[1] + 2u > len) {
+		return -1;
+	}
+
+	tx_channel &t = tx[channel];
+	tx_entry &e = t.window[t.next_seq % DMX_LINK_MAX_WINDOW];
+	if(e.used) {
+		// more unacknowledged frames than the window allows
+		return -1;
+	}
+
+	const size_t payload = plain[1];
+	shared_buffer block = frame_pool->acquire();
+	uint8_t *d = block.data();
+	d[0] = plain[0];
+	d[1] = payload;
+	d[2] = t.next_seq;
+	memcpy(d + 3,plain + 2,payload);
+	const uint16_t crc = crc16(d,payload + 3);
+	d[payload + 3] = crc;
+	d[payload + 4] = crc >> 8;
+
+	e.used = true;
+	e.seq = t.next_seq++;
+	e.frame = block.slice(0,payload + DMX_LINK_OVERHEAD);
+	e.payload = payload;
+	e.callback = callback;
+	e.retries = 0;
+	unacked++;
+	transmit(channel,e);
+
+	run_collected(lock);
+	return 0;
+}
+
+// written by run_collected once the mutex is released
+void dmx_link::transmit(size_t channel, tx_entry &e) {
+	e.queued = true;
+	e.attempt = ++attempts;
+	if(!e.attempt) e.attempt = ++attempts;
+
+	pending_write w = { channel, e.frame, e.seq, e.attempt };
+	writes.push_back(w);
+}
+
+void dmx_link::send_control(uint8_t type, uint8_t arg1, uint8_t arg2, uint8_t arg3) {
+	shared_buffer block = frame_pool->acquire();
+	uint8_t *d = block.data();
+	d[0] = 0;
+	d[1] = 4;
+	d[2] = 0;
+	d[3] = type;
+	d[4] = arg1;
+	d[5] = arg2;
+	d[6] = arg3;
+	const uint16_t crc = crc16(d,7);
+	d[7] = crc;
+	d[8] = crc >> 8;
+
+	pending_write w = { channels, block.slice(0,DMX_LINK_CONTROL_SIZE), 0, 0 };
+	writes.push_back(w);
+}
+
+void dmx_link::send_hello(uint8_t type) {
+	send_control(type,DMX_LINK_VERSION,local_epoch & 0xff,local_epoch >> 8);
+}
+
+void dmx_link::send_skip(size_t channel) {
+	tx_channel &t = tx[channel];
+	t.skip_ns = usb::monotonic_ns();
+	send_control(DMX_LINK_SKIP,channel + 1,t.skip_to,0);
+}
+
+/* ------------------------------------ */
+
+void dmx_link::dispatch(const shared_buffer &buffer) {
+	boost::unique_lock<boost::mutex> lock(mutex);
+
+	if(carry.empty()) {
+		const size_t used = parse(buffer.data(),buffer.size(),&buffer,buffer.timestamp());
+		carry.assign(buffer.data() + used,buffer.data() + buffer.size());
+	} else {
+		// rarely more than a frame, copied so the split one can be parsed
+		carry.insert(carry.end(),buffer.data(),buffer.data() + buffer.size());
+		const size_t used = parse(&carry[0],carry.size(),0,buffer.timestamp());
+		carry.erase(carry.begin(),carry.begin() + used);
+	}
+
+	run_collected(lock);
+}
+
+// returns the bytes consumed, the rest is an incomplete frame
+size_t dmx_link::parse(const uint8_t *d, size_t len, const shared_buffer *owner, uint64_t stamp) {
+	size_t pos = 0;
+	while(len - pos >= 3) {
+		const uint8_t addr = d[pos];
+		const uint8_t payload = d[pos + 1];
+		if(addr > channels || payload > DMX_LINK_MAX_PAYLOAD) {
+			bad_headers.fetch_add(1,std::memory_order_relaxed);
+			pos++;
+			continue;
+		}
+
+		const size_t total = payload + DMX_LINK_OVERHEAD;
+		if(len - pos < total) break;
+
+		const uint16_t crc = d[pos + payload + 3] | (d[pos + payload + 4] << 8);
+		if(crc16(d + pos,payload + 3) != crc) {
+			// the header may have been garbage, resync on the next byte
+			crc_errors.fetch_add(1,std::memory_order_relaxed);
+			pos++;
+			continue;
+		}
+
+		if(addr == 0) {
+			control_received(d + pos + 3,payload);
+		} else {
+			shared_buffer data;
+			if(owner) {
+				data = owner->slice(pos + 3,payload);
+			} else {
+				data = payload_pool->acquire();
+				memcpy(data.data(),d + pos + 3,payload);
+				data = data.slice(0,payload);
+				data.set_timestamp(stamp);
+			}
+			frame_received(addr,d[pos + 2],data);
+		}
+		pos += total;
+	}
+	return pos;
+}
+
+void dmx_link::frame_received(uint8_t addr, uint8_t seq, const shared_buffer &payload) {
+	rx_channel &r = rx[addr - 1];
+
+	const uint8_t ahead = seq - r.expected;
+	if(ahead == 0) {
+		if(payload.size()) {
+			arrival a = { addr, false, payload };
+			arrivals.push_back(a);
+		}
+		send_control(DMX_LINK_ACK,addr,seq,0);
+		r.expected++;
+		r.nak_sent = false;
+		deliver_held(addr);
+	} else if(ahead < DMX_LINK_MAX_WINDOW) {
+		// acknowledged once it is delivered
+		shared_buffer &slot = r.held[seq % DMX_LINK_MAX_WINDOW];
+		if(slot) {
+			duplicates.fetch_add(1,std::memory_order_relaxed);
+		} else if(payload) {
+			slot = payload;
+		} else {
+			// keep an empty frame's place in the sequence
+			slot = payload_pool->acquire().slice(0,0);
+		}
+
+		if(!r.nak_sent) {
+			send_control(DMX_LINK_NAK,addr,r.expected,0);
+			naks_sent.fetch_add(1,std::memory_order_relaxed);
+			r.nak_sent = true;
+		}
+	} else if((uint8_t)(r.expected - seq) <= DMX_LINK_MAX_WINDOW) {
+		// already delivered, the ACK got lost
+		duplicates.fetch_add(1,std::memory_order_relaxed);
+		send_control(DMX_LINK_ACK,addr,seq,0);
+	} else {
+		out_of_window.fetch_add(1,std::memory_order_relaxed);
+	}
+}
+
+// frames that arrived ahead of the one just delivered
+void dmx_link::deliver_held(uint8_t addr) {
+	rx_channel &r = rx[addr - 1];
+	for(;;) {
+		shared_buffer &next = r.held[r.expected % DMX_LINK_MAX_WINDOW];
+		if(!next) break;
+		if(next.size()) {
+			arrival a = { addr, false, next };
+			arrivals.push_back(a);
+		}
+		send_control(DMX_LINK_ACK,addr,r.expected,0);
+		next = shared_buffer();
+		r.expected++;
+	}
+}
+
+void dmx_link::skip_received(uint8_t addr, uint8_t to) {
+	rx_channel &r = rx[addr - 1];
+
+	// the sender never has more than a window in flight, a SKIP further
+	// ahead was applied before and expected moved past it since
+	const uint8_t ahead = to - r.expected;
+	if(ahead <= DMX_LINK_MAX_WINDOW) {
+		for(uint8_t seq = r.expected; seq != to; seq++) {
+			r.held[seq % DMX_LINK_MAX_WINDOW] = shared_buffer();
+		}
+		r.expected = to;
+		r.nak_sent = false;
+		skips.fetch_add(1,std::memory_order_relaxed);
+
+		arrival a = { addr, true, shared_buffer() };
+		arrivals.push_back(a);
+		deliver_held(addr);
+	}
+	send_control(DMX_LINK_SKIP_ACK,addr,to,0);
+}
+
+void dmx_link::control_received(const uint8_t *payload, size_t len) {
+	if(len < 4) return;
+
+	const uint8_t type = payload[0];
+	const uint8_t addr = payload[1];
+	const uint8_t seq = payload[2];
+	const uint16_t epoch = payload[2] | (payload[3] << 8);
+
+	switch(type) {
+	case DMX_LINK_HELLO:
+		if(payload[1] != DMX_LINK_VERSION) {
+			LOG_WARNING(dmx,"link layer hello with version %i, expected %i",(int)payload[1],DMX_LINK_VERSION);
+			break;
+		}
+		if(epoch != peer_epoch) {
+			LOG_INFO(dmx,"link layer hello from peer, epoch %u",epoch);
+			// the peer starts over, numbering included; while negotiating
+			// this end has just done so itself
+			if(current != state_negotiating) reset();
+			peer_epoch = epoch;
+		}
+		send_hello(DMX_LINK_HELLO_ACK);
+		if(current != state_active) resolve(state_active);
+		break;
+	case DMX_LINK_HELLO_ACK:
+		// a late answer to an earlier HELLO changes nothing
+		if(current == state_negotiating && payload[1] == DMX_LINK_VERSION) {
+			peer_epoch = epoch;
+			resolve(state_active);
+		}
+		break;
+	case DMX_LINK_ACK:
+	case DMX_LINK_NAK:
+		if(addr == 0 || addr > channels) break;
+		{
+			tx_entry &e = tx[addr - 1].window[seq % DMX_LINK_MAX_WINDOW];
+			if(!e.used || e.seq != seq) break;
+
+			if(type == DMX_LINK_ACK) {
+				completed.push_back(completion(e.callback,0));
+				e.used = false;
+				e.frame = shared_buffer();
+				unacked--;
+			} else if(!e.queued) {
+				// a copy still waiting to be written answers the NAK
+				e.retries++;
+				retransmits.fetch_add(1,std::memory_order_relaxed);
+				transmit(addr - 1,e);
+			}
+		}
+		break;
+	case DMX_LINK_SKIP:
+		if(addr == 0 || addr > channels) break;
+		skip_received(addr,seq);
+		break;
+	case DMX_LINK_SKIP_ACK:
+		if(addr == 0 || addr > channels) break;
+		{
+			tx_channel &t = tx[addr - 1];
+			if(t.skipping && t.skip_to == seq) {
+				t.skipping = false;
+			}
+		}
+		break;
+	}
+}
+
+dmx_link_stats dmx_link::stats() const {
+	dmx_link_stats s;
+	s.bad_headers = bad_headers.load(std::memory_order_relaxed);
+	s.crc_errors = crc_errors.load(std::memory_order_relaxed);
+	s.retransmits = retransmits.load(std::memory_order_relaxed);
+	s.failed = failed.load(std::memory_order_relaxed);
+	s.naks_sent = naks_sent.load(std::memory_order_relaxed);
+	s.duplicates = duplicates.load(std::memory_order_relaxed);
+	s.out_of_window = out_of_window.load(std::memory_order_relaxed);
+	s.skips = skips.load(std::memory_order_relaxed);
+	return s;
+}
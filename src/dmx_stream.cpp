@@ -0,0 +1,437 @@
+#include <dmx_stream.h>
+
+#include <log.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <boost/make_shared.hpp>
+#include <boost/bind.hpp>
+
+dmx_stream::dmx_stream(sender_t _sender, uint32_t _index, bool _variable, size_t _window,
+                       bool _compress)
+:sender(_sender),addr(_index),variable(_variable),window(std::max<size_t>(_window,1)),
+ frame_pool(buffer_pool::create(sizeof(buffer_t),window * 2)),
+ encoder(_compress ? new dmx_encoder : 0),plain_bytes(0),coded_bytes(0),in_flight(0),generation(0) {
+	
+}
+
+dmx_stream::~dmx_stream() {
+	LOG_TRACE(dmx,"~dmx_stream");
+}
+
+int dmx_stream::send(void *data, size_t len, base_stream::send_callback callback) {
+	if(!len) {
+		callback(0,0);
+		return 0;
+	}
+	
+	const size_t max_payload = sizeof(buffer_t::data);
+	boost::shared_ptr<send_op> op(new send_op);
+	op->callback = callback;
+	op->frames = 0;
+	op->status = 0;
+	op->len = 0;
+	
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		
+		const uint8_t *d = (const uint8_t*)data;
+		for(size_t offset = 0; offset < len; op->frames++) {
+			shared_buffer block = frame_pool->acquire();
+			buffer_t *frame = (buffer_t*)block.data();
+			frame->addr = addr;
+			
+			size_t used;
+			if(encoder) {
+				frame->len = encoder->encode(d + offset,len - offset,frame->data,max_payload,used);
+			} else {
+				used = std::min(max_payload,len - offset);
+				frame->len = used;
+				memcpy(frame->data,d + offset,used);
+			}
+			if(!variable) {
+				memset(frame->data + frame->len,0,max_payload - frame->len);
+			}
+			plain_bytes.fetch_add(used,std::memory_order_relaxed);
+			coded_bytes.fetch_add(frame->len,std::memory_order_relaxed);
+			
+			out_frame f = { block.slice(0,variable ? frame->len + 2 : sizeof(buffer_t)),used,op,generation };
+			pending.push_back(f);
+			offset += used;
+		}
+		
+		if(pending.size() > window && !congested()) {
+			set_congested(true);
+		}
+	}
+	
+	pump();
+	return 0;
+}
+
+void dmx_stream::pump() {
+	boost::shared_ptr<dmx_stream> self = shared_from_this();
+	
+	for(;;) {
+		out_frame f;
+		{
+			boost::lock_guard<boost::mutex> lock(mutex);
+			if(pending.empty() || in_flight >= window) return;
+			f = pending.front();
+			pending.pop_front();
+			in_flight++;
+		}
+		
+		// the callback keeps the stream and the pooled frame alive until
+		// the sender is done with it
+		int ret = sender(f.frame.data(),f.frame.size(),[self,f](int status, size_t) {
+			self->frame_done(f,status);
+		});
+		if(ret < 0) {
+			frame_done(f,ret);
+		}
+	}
+}
+
+void dmx_stream::frame_done(const out_frame &f, int status) {
+	bool done;
+	std::vector< boost::shared_ptr<send_op> > failed;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		in_flight--;
+		
+		// coded against a history the peer has dropped since, it
+		// discarded the frame
+		const bool stale = encoder && f.generation != generation;
+		if(stale && !status) {
+			status = -1;
+		}
+		
+		send_op &op = *f.op;
+		if(status && !op.status) {
+			op.status = status;
+		}
+		if(!status) {
+			op.len += f.payload;
+		}
+		done = --op.frames == 0;
+		
+		// the peer misses this frame's bytes in its history
+		if(encoder && status && !stale) {
+			restart_history(failed);
+		}
+		
+		if(pending.empty() && congested()) {
+			set_congested(false);
+		}
+	}
+	
+	if(done) {
+		f.op->callback(f.op->status,f.op->len);
+	}
+	for(auto &op : failed) {
+		op->callback(op->status,op->len);
+	}
+	pump();
+}
+
+void dmx_stream::restart() {
+	std::vector< boost::shared_ptr<send_op> > failed;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if(!encoder) return;
+		
+		restart_history(failed);
+		if(congested()) {
+			set_congested(false);
+		}
+	}
+	
+	for(auto &op : failed) {
+		op->callback(op->status,op->len);
+	}
+}
+
+// frames not handed to the sender yet are coded against the old history
+void dmx_stream::restart_history(std::vector< boost::shared_ptr<send_op> > &done) {
+	encoder->reset();
+	generation++;
+	
+	for(auto &f : pending) {
+		send_op &op = *f.op;
+		if(!op.status) {
+			op.status = -1;
+		}
+		if(--op.frames == 0) {
+			done.push_back(f.op);
+		}
+	}
+	pending.clear();
+}
+
+dmx_compress_stats dmx_stream::sent_stats() const {
+	dmx_compress_stats s;
+	s.plain = plain_bytes.load(std::memory_order_relaxed);
+	s.coded = coded_bytes.load(std::memory_order_relaxed);
+	s.errors = 0;
+	return s;
+}
+
+/* ------------------------------------ */
+
+dmx_mux::dmx_mux(sender_t sender, size_t channels, boost::asio::io_service *io_svc)
+:header_have(0),frame_addr(0),frame_len(0),payload_have(0),
+ fixed_frames(getenv("DMX_VARIABLE_FRAMES") == 0),padding(0),
+ reassembly_pool(buffer_pool::create(sizeof(dmx_stream::buffer_t::data),2)),
+ frames(0),bytes(0),reassembled(0),bad_addr(0),bad_len(0),restarted(false),
+ // every 2 byte match token may stand for DMX_MATCH_MAX bytes
+ decode_pool(buffer_pool::create(sizeof(dmx_stream::buffer_t::data) * DMX_MATCH_MAX / 2,4))
+{
+	std::fill(table,table + 256,(base_stream*)0);
+	
+	const char *window = getenv("DMX_WINDOW");
+	
+	channels = std::min<size_t>(channels,255);
+	
+	sender_t stream_sender = sender;
+	if(io_svc && getenv("DMX_LINK")) {
+		link.reset(new dmx_link(*io_svc,sender,
+		                        boost::bind(&dmx_mux::link_deliver,this,_1,_2),
+		                        boost::bind(&dmx_mux::link_lost,this,_1),channels));
+		dmx_link *l = link.get();
+		stream_sender = [l](size_t channel, void *data, size_t len, base_stream::send_callback cb) {
+			return l->send(channel,data,len,cb);
+		};
+	}
+	
+	// the coding history needs every frame, in order
+	decompressors.resize(channels + 1);
+	const char *list = getenv("DMX_COMPRESS");
+	if(list && *list && !link) {
+		LOG_WARNING(dmx,"DMX_COMPRESS needs the link layer (DMX_LINK), not compressing");
+		list = 0;
+	}
+	while(list && *list) {
+		char *end;
+		const unsigned long channel = strtoul(list,&end,0);
+		if(end == list) break;
+		if(channel >= 1 && channel <= channels) {
+			decompressors[channel].reset(new decompressor);
+			link->require(channel - 1);
+			LOG_INFO(dmx,"compressing channel %lu",channel);
+		}
+		list = *end ? end + 1 : end;
+	}
+	
+	for(size_t i = 0; i < channels; i++) {
+		auto channel_sender = [stream_sender,i](void *data, size_t len, base_stream::send_callback cb) {
+			return stream_sender(i,data,len,cb);
+		};
+		streams.push_back(boost::make_shared<dmx_stream>(channel_sender,i+1,!fixed_frames,
+		                                                window ? strtoul(window,0,0) : 4,
+		                                                decompressors[i + 1].get() != 0));
+		table[i + 1] = streams.back().get();
+	}
+	
+	if(link) {
+		link->negotiate();
+	}
+}
+
+void dmx_mux::set_line_rate(size_t bytes_per_second, size_t write_bytes) {
+	if(link) {
+		link->set_line_rate(bytes_per_second,write_bytes);
+	}
+}
+
+void dmx_mux::link_deliver(uint8_t addr, const shared_buffer &payload) {
+	frame_addr = addr;
+	frame_done(payload,true);
+}
+
+void dmx_mux::link_lost(uint8_t addr) {
+	if(addr) {
+		if(decompressor *dc = decompressors[addr].get()) {
+			dc->decoder.lose();
+		}
+		return;
+	}
+	
+	// any thread: the histories are void both ways, the decompressors
+	// are left to the thread delivering frames
+	for(auto &s : streams) {
+		s->restart();
+	}
+	restarted = true;
+}
+
+void dmx_mux::frame_done(const shared_buffer &payload, bool linked) {
+	header_have = 0;
+	payload_have = 0;
+	frames.fetch_add(1,std::memory_order_relaxed);
+	bytes.fetch_add(payload.size(),std::memory_order_relaxed);
+	
+	decompressor *dc = decompressors[frame_addr].get();
+	if(!dc) {
+		table[frame_addr]->deliver(payload);
+		return;
+	}
+	
+	if(!linked) {
+		// compressed frames are refused without an active link
+		dc->errors.fetch_add(1,std::memory_order_relaxed);
+		return;
+	}
+	
+	if(restarted.load(std::memory_order_relaxed) && restarted.exchange(false)) {
+		for(auto &d : decompressors) {
+			if(d) d->decoder.lose();
+		}
+	}
+	
+	shared_buffer plain = decode_pool->acquire();
+	const int len = dc->decoder.decode(payload.data(),payload.size(),plain.data(),plain.size());
+	if(len < 0) {
+		// discarded until the peer restarts its history
+		dc->errors.fetch_add(1,std::memory_order_relaxed);
+		return;
+	}
+	dc->coded.fetch_add(payload.size(),std::memory_order_relaxed);
+	dc->plain.fetch_add(len,std::memory_order_relaxed);
+	
+	if(len) {
+		plain = plain.slice(0,len);
+		plain.set_timestamp(payload.timestamp());
+		table[frame_addr]->deliver(plain);
+	}
+}
+
+void dmx_mux::frame_padding() {
+	if(fixed_frames) {
+		padding = sizeof(dmx_stream::buffer_t::data) - frame_len;
+	}
+}
+
+void dmx_mux::dispatch(const shared_buffer &buffer) {
+	if(link && link->state() != dmx_link::state_plain) {
+		link->dispatch(buffer);
+		return;
+	}
+	
+	const uint8_t *d = buffer.data();
+	const size_t len = buffer.size();
+	size_t pos = 0;
+	
+	while(pos < len) {
+		if(padding) {
+			const size_t n = std::min(padding,len - pos);
+			padding -= n;
+			pos += n;
+			continue;
+		}
+		
+		if(header_have == 0) {
+			frame_addr = d[pos++];
+			if(!table[frame_addr]) {
+				bad_addr.fetch_add(1,std::memory_order_relaxed);
+				continue;
+			}
+			header_have = 1;
+			continue;
+		}
+		
+		if(header_have == 1) {
+			frame_len = d[pos++];
+			if(frame_len > sizeof(dmx_stream::buffer_t::data)) {
+				// the address byte was garbage, the length byte may
+				// still start the next frame
+				bad_len.fetch_add(1,std::memory_order_relaxed);
+				header_have = 0;
+				pos--;
+				continue;
+			}
+			// empty frames carry nothing to deliver
+			header_have = frame_len ? 2 : 0;
+			if(!frame_len) frame_padding();
+			continue;
+		}
+		
+		const size_t available = len - pos;
+		if(payload_have == 0 && available >= frame_len) {
+			// whole payload in this chunk, handed out without a copy
+			frame_done(buffer.slice(pos,frame_len),false);
+			frame_padding();
+			pos += frame_len;
+			continue;
+		}
+		
+		if(payload_have == 0) {
+			reassembly = reassembly_pool->acquire();
+		}
+		const size_t n = std::min<size_t>(frame_len - payload_have,available);
+		memcpy(reassembly.data() + payload_have,d + pos,n);
+		payload_have += n;
+		pos += n;
+		
+		if(payload_have == frame_len) {
+			shared_buffer payload = reassembly.slice(0,frame_len);
+			payload.set_timestamp(buffer.timestamp());
+			reassembly = shared_buffer();
+			reassembled.fetch_add(1,std::memory_order_relaxed);
+			frame_done(payload,false);
+			frame_padding();
+		}
+	}
+}
+
+dmx_parse_stats dmx_mux::stats() const {
+	dmx_parse_stats s;
+	s.frames = frames.load(std::memory_order_relaxed);
+	s.bytes = bytes.load(std::memory_order_relaxed);
+	s.reassembled = reassembled.load(std::memory_order_relaxed);
+	s.bad_addr = bad_addr.load(std::memory_order_relaxed);
+	s.bad_len = bad_len.load(std::memory_order_relaxed);
+	return s;
+}
+
+void dmx_mux::log_stats() const {
+	dmx_parse_stats s = stats();
+	LOG_INFO(dmx,"%llu frames, %llu bytes, %llu reassembled, %llu bad addresses, %llu bad lengths",
+	         (unsigned long long)s.frames,(unsigned long long)s.bytes,
+	         (unsigned long long)s.reassembled,(unsigned long long)s.bad_addr,
+	         (unsigned long long)s.bad_len);
+	
+	if(link) {
+		dmx_link_stats l = link->stats();
+		LOG_INFO(dmx,"link: %llu bad headers, %llu crc errors, %llu retransmits, %llu failed, "
+		             "%llu naks sent, %llu duplicates, %llu out of window, %llu skips",
+		         (unsigned long long)l.bad_headers,(unsigned long long)l.crc_errors,
+		         (unsigned long long)l.retransmits,(unsigned long long)l.failed,
+		         (unsigned long long)l.naks_sent,(unsigned long long)l.duplicates,
+		         (unsigned long long)l.out_of_window,(unsigned long long)l.skips);
+	}
+	
+	for(size_t addr = 1; addr < decompressors.size(); addr++) {
+		const decompressor *dc = decompressors[addr].get();
+		if(!dc) continue;
+		
+		const dmx_compress_stats tx = streams[addr - 1]->sent_stats();
+		const uint64_t rx_plain = dc->plain.load(std::memory_order_relaxed);
+		const uint64_t rx_coded = dc->coded.load(std::memory_order_relaxed);
+		LOG_INFO(dmx,"channel %zu: sent %llu bytes as %llu (%lld saved), "
+		             "received %llu bytes as %llu (%lld saved), %llu decode errors",
+		         addr,(unsigned long long)tx.plain,(unsigned long long)tx.coded,
+		         (long long)(tx.plain - tx.coded),
+		         (unsigned long long)rx_plain,(unsigned long long)rx_coded,
+		         (long long)(rx_plain - rx_coded),
+		         (unsigned long long)dc->errors.load(std::memory_order_relaxed));
+	}
+}
+
+size_t dmx_mux::size() const {
+	return streams.size();
+}
+
+boost::shared_ptr<base_stream> dmx_mux::get_stream(size_t i) {
+	return streams[i];
+}
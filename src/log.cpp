@@ -0,0 +1,239 @@
+#include <log.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/bind.hpp>
+
+using namespace logging;
+
+namespace {
+
+const char *category_names[category_count] = {
+	"usb", "cp210x", "stream", "dmx", "app"
+};
+
+const char level_names[] = { 'E', 'W', 'I', 'D', 'T' };
+
+// AKEMI_LOG_LEVEL=<0..4> sets every category, the legacy DEBUG_* switches
+// raise a single category to debug
+int initial_level(category_t category) {
+	int level = info;
+	if(const char *env = getenv("AKEMI_LOG_LEVEL")) {
+		level = atoi(env);
+	}
+	
+	const char *legacy = 0;
+	switch(category) {
+	case usb:
+	case cp210x: legacy = "DEBUG_USB"; break;
+	case stream: legacy = "DEBUG_STREAM_CONNECTION"; break;
+	case dmx:    legacy = "DEBUG_DMX"; break;
+	case app:    legacy = "DEBUG_HOMURA"; break;
+	default: break;
+	}
+	
+	if(legacy && getenv(legacy) && level < debug) {
+		level = debug;
+	}
+	
+	return level;
+}
+
+/* ------------------------------------ */
+
+// bounded multi-producer ring (D. Vyukov's sequence-per-cell scheme),
+// consumed by a single drain thread
+class sink
+{
+	static const size_t ring_size = 1024;
+	static const size_t message_size = 496;
+	
+	struct cell {
+		std::atomic<size_t> sequence;
+		size_t len;
+		char text[message_size];
+	};
+	
+	cell cells[ring_size];
+	std::atomic<size_t> enqueue_pos;
+	std::atomic<size_t> dequeue_pos;
+	std::atomic<size_t> dropped;
+	
+	// set by the drain thread before it waits on wakeup, producers only
+	// take the mutex to notify while it is set
+	std::atomic<bool> sleeping;
+	boost::mutex wakeup_mutex;
+	boost::condition_variable wakeup;
+	
+	boost::thread drainer;
+	
+	bool pending() const;
+	
+	void drain_thread_func();
+	size_t drain();
+	
+	sink();
+public:
+	static sink& instance();
+	
+	void push(category_t category, level_t level, const char *format, va_list args);
+	void flush();
+};
+
+sink::sink():enqueue_pos(0),dequeue_pos(0),dropped(0),sleeping(false) {
+	for(size_t i = 0; i < ring_size; i++) {
+		cells[i].sequence.store(i,std::memory_order_relaxed);
+	}
+	
+	drainer = boost::thread(boost::bind(&sink::drain_thread_func,this));
+	atexit(logging::flush);
+}
+
+// never destroyed, static destructors may still log
+sink& sink::instance() {
+	static sink *s = new sink;
+	return *s;
+}
+
+void sink::push(category_t category, level_t level, const char *format, va_list args) {
+	size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+	cell *c;
+	for(;;) {
+		c = &cells[pos & (ring_size - 1)];
+		size_t seq = c->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if(diff == 0) {
+			if(enqueue_pos.compare_exchange_weak(pos,pos + 1,std::memory_order_relaxed)) break;
+		} else if(diff < 0) {
+			// ring is full: errors and warnings bypass it, the rest is counted
+			if(level <= warning) {
+				fprintf(stderr,"%c %s: ",level_names[level],category_names[category]);
+				vfprintf(stderr,format,args);
+				fputc('\n',stderr);
+			} else {
+				dropped.fetch_add(1);
+			}
+			return;
+		} else {
+			pos = enqueue_pos.load(std::memory_order_relaxed);
+		}
+	}
+	
+	int len = snprintf(c->text,message_size,"%c %s: ",level_names[level],category_names[category]);
+	int ret = vsnprintf(c->text + len,message_size - len,format,args);
+	len = ret < 0 ? len : std::min<int>(len + ret,message_size - 1);
+	while(len && c->text[len - 1] == '\n') len--;
+	c->text[len++] = '\n';
+	c->len = len;
+	
+	c->sequence.store(pos + 1);
+	
+	// pairs with the store of sleeping and the check of pending() in the
+	// drain thread: one of the two sides sees the other
+	if(sleeping.load()) {
+		boost::lock_guard<boost::mutex> lock(wakeup_mutex);
+		sleeping = false;
+		wakeup.notify_one();
+	}
+}
+
+bool sink::pending() const {
+	const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+	return cells[pos & (ring_size - 1)].sequence.load() == pos + 1 || dropped.load() != 0;
+}
+
+size_t sink::drain() {
+	char out[8192];
+	size_t out_len = 0;
+	size_t count = 0;
+	
+	size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+	for(;;) {
+		cell *c = &cells[pos & (ring_size - 1)];
+		if(c->sequence.load(std::memory_order_acquire) != pos + 1) break;
+		
+		if(out_len + c->len > sizeof(out)) {
+			fwrite(out,1,out_len,stderr);
+			out_len = 0;
+		}
+		memcpy(out + out_len,c->text,c->len);
+		out_len += c->len;
+		
+		c->sequence.store(pos + ring_size,std::memory_order_release);
+		pos++;
+		count++;
+	}
+	dequeue_pos.store(pos,std::memory_order_release);
+	
+	if(size_t lost = dropped.exchange(0,std::memory_order_relaxed)) {
+		char note[64];
+		int len = snprintf(note,sizeof(note),"W log: %zu messages dropped\n",lost);
+		len = std::min<int>(std::max(len,0),sizeof(note) - 1);
+		if(out_len + len > sizeof(out)) {
+			fwrite(out,1,out_len,stderr);
+			out_len = 0;
+		}
+		memcpy(out + out_len,note,len);
+		out_len += len;
+	}
+	
+	if(out_len) {
+		fwrite(out,1,out_len,stderr);
+		fflush(stderr);
+	}
+	
+	return count;
+}
+
+void sink::drain_thread_func() {
+	for(;;) {
+		if(drain()) continue;
+		
+		boost::unique_lock<boost::mutex> lock(wakeup_mutex);
+		sleeping = true;
+		while(sleeping && !pending()) {
+			wakeup.wait(lock);
+		}
+		sleeping = false;
+	}
+}
+
+void sink::flush() {
+	const size_t target = enqueue_pos.load(std::memory_order_acquire);
+	for(int i = 0; i < 500 && dequeue_pos.load(std::memory_order_acquire) < target; i++) {
+		usleep(2000);
+	}
+}
+
+} //namespace
+
+/* ------------------------------------ */
+
+std::atomic<int> logging::thresholds[category_count] = {
+	{ initial_level(usb) },
+	{ initial_level(cp210x) },
+	{ initial_level(stream) },
+	{ initial_level(dmx) },
+	{ initial_level(app) }
+};
+
+void logging::set_level(category_t category, level_t level) {
+	thresholds[category].store(level,std::memory_order_relaxed);
+}
+
+void logging::write(category_t category, level_t level, const char *format, ...) {
+	va_list args;
+	va_start(args,format);
+	sink::instance().push(category,level,format,args);
+	va_end(args);
+}
+
+void logging::flush() {
+	sink::instance().flush();
+}
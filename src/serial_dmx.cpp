@@ -1,99 +1,216 @@
 #include <serial_dmx.h>
 
-#include <iostream>
-#include <boost/make_shared.hpp>
-#include <usb.h>
+#include <log.h>
+#include <usb_trace.h>
+#include <algorithm>
+
+// a full frame always fits in one quantum of weight 1
+#define DMX_QUANTUM sizeof(dmx_stream::buffer_t)
+// the largest frame a channel queues, a link layer frame
+#define DMX_MAX_FRAME std::max<size_t>(DMX_QUANTUM,DMX_LINK_MAX_PAYLOAD + DMX_LINK_OVERHEAD)
+
+dmx_scheduler::channel::channel()
+:priority(0),weight(1),deficit(0)
+{
 
-dmx_stream::dmx_stream(sender_t _sender, uint32_t _index):sender(_sender) {
-	buffer.addr = _index;
 }
 
-dmx_stream::~dmx_stream() {
-	std::cerr << "~dmx_stream" << std::endl;
+dmx_scheduler::dmx_scheduler(boost::asio::io_service &io_svc, dmx_stream::sender_t _link, size_t count)
+:link(_link),pacer(io_svc),channels(count),cursor(0),granted(false),busy(false),pacing(false),
+ pack_limit(4 * DMX_QUANTUM),
+ rate(0),burst(0),tokens(0),refilled_ns(usb::monotonic_ns())
+{
+
 }
 
-int dmx_stream::send(void *data, size_t len, base_stream::send_callback callback) {
-	
-	buffer.len = std::min(sizeof(buffer.data), len);
-	memcpy(buffer.data, data, buffer.len);
-	
-	uint8_t *next_data = (uint8_t*)data + buffer.len;
-	size_t next_len = len - buffer.len;
-	
-	auto cb = [this,next_data,next_len, callback](int status, size_t len) {
-		if(status) {
-			callback(status, len);
-		}
-		if(next_len) {
-			this->send(next_data,next_len,callback);
-		} else {
-			callback(0, len);
-		}
-	};
+dmx_scheduler::~dmx_scheduler() {
+	LOG_TRACE(dmx,"~dmx_scheduler");
+}
+
+void dmx_scheduler::set_rate(uint32_t bytes_per_second, size_t burst_bytes) {
+	rate = bytes_per_second;
+	burst = std::max<size_t>(burst_bytes,DMX_MAX_FRAME);
+	tokens = burst;
+	refilled_ns = usb::monotonic_ns();
+	LOG_INFO(dmx,"pacing at %u bytes/s, burst %zu",rate,burst);
+}
+
+void dmx_scheduler::set_pack_limit(size_t bytes) {
+	pack_limit = bytes;
+}
+
+size_t dmx_scheduler::get_pack_limit() const {
+	return pack_limit;
+}
+
+void dmx_scheduler::set_channel(size_t index, int priority, uint32_t weight) {
+	if(index >= channels.size()) return;
+	channels[index].priority = priority;
+	channels[index].weight = std::max<uint32_t>(weight,1);
+	LOG_INFO(dmx,"channel %zu: priority %i weight %u",index,priority,channels[index].weight);
+}
+
+int dmx_scheduler::send(size_t index, void *data, size_t len, base_stream::send_callback callback) {
+	if(index >= channels.size()) {
+		return -1;
+	}
 	
-	return sender(&buffer, sizeof(buffer)/*buffer.len + 2*/, cb);
+	frame f = { data, len, callback };
+	channels[index].queue.push_back(f);
+	pump();
+	return 0;
 }
 
-serial_dmx::serial_dmx(boost::asio::io_service &io_svc):serial(io_svc,"/dev/ttyUSB1") {
+// deficit round robin over the non-empty channels of the highest
+// priority present, -1 when every queue is empty
+int dmx_scheduler::select() {
+	bool any = false;
+	int best = 0;
+	for(auto &c : channels) {
+		if(c.queue.empty()) continue;
+		if(!any || c.priority > best) best = c.priority;
+		any = true;
+	}
+	if(!any) return -1;
 	
-	auto sender = [this](void *data, size_t len, base_stream::send_callback cb) {
-		return this->serial.send(data,len,cb);
-	};
+	for(;;) {
+		channel &c = channels[cursor];
+		if(c.queue.empty()) {
+			// an idle channel does not save up credit
+			c.deficit = 0;
+		} else if(c.priority == best) {
+			if(!granted) {
+				c.deficit += c.weight * DMX_QUANTUM;
+				granted = true;
+			}
+			const size_t len = c.queue.front().len;
+			if(len <= c.deficit) {
+				c.deficit -= len;
+				return cursor;
+			}
+		}
 		
-	for(uint32_t i = 0; i < 6; i++) {
-		streams.push_back(boost::make_shared<dmx_stream>(sender,i+1));
+		cursor = (cursor + 1) % channels.size();
+		granted = false;
 	}
-		
-	connection = serial.data_received.connect([this](void *data, size_t len) {
-		return this->dispatch(data,len);
-	});
 }
 
-serial_dmx::~serial_dmx() {
-	std::cerr << "~serial_dmx" << std::endl;
-	connection.disconnect();
+void dmx_scheduler::refill() {
+	const uint64_t now = usb::monotonic_ns();
+	tokens = std::min<double>(burst,tokens + (now - refilled_ns) * 1e-9 * rate);
+	refilled_ns = now;
 }
 
-void serial_dmx::dispatch(void *data, size_t len) {
-	uint8_t *d = (uint8_t*)data;
-	while(len != 0) {
-		std::cerr << "data: " << usb::format_bytes(data,len).get() << std::endl;
-
-		struct header_t {
-			uint8_t addr;
-			uint8_t len;
-			uint8_t data[0];
-		} __attribute__((packed)) *header = (header_t*)d;
-	
-		if(len < sizeof(header_t)) {
-			std::cerr << "incorrect packet received with len " << len << std::endl;
-			return;
-		}
-	
-		std::cerr << (int)header->addr << " " << (int)header->len << std::endl;
-	
-		if(header->addr == 0 || header->addr > streams.size()) {
-			std::cerr << "incorrect addr = " << header->addr << std::endl;
-			return;
+void dmx_scheduler::pump() {
+	while(!busy && !pacing) {
+		if(rate) refill();
+		
+		pack.clear();
+		packed.clear();
+		for(;;) {
+			int index = select();
+			if(index < 0) break;
+			
+			channel &c = channels[index];
+			frame &f = c.queue.front();
+			const size_t total = pack.size() + f.len;
+			
+			// a lone frame larger than the bucket goes once it is full
+			// and leaves it in debt, it would never fit otherwise
+			const double needed = pack.empty() ? std::min<double>(f.len,burst) : total;
+			const bool too_big = !pack.empty() && total > pack_limit;
+			const bool too_early = rate && tokens < needed;
+			if(too_big || too_early) {
+				// the deficit taken by select is given back, the frame is
+				// picked first next time
+				c.deficit += f.len;
+				if(pack.empty()) {
+					// nothing to send until the line caught up
+					const uint64_t wait_us = (needed - tokens) * 1e6 / rate + 1;
+					pacing = true;
+					pacer.expires_from_now(boost::posix_time::microseconds(wait_us));
+					pacer.async_wait([this](const boost::system::error_code &error) {
+						if(error) return;
+						this->pacing = false;
+						this->pump();
+					});
+					return;
+				}
+				break;
+			}
+			
+			const uint8_t *data = (const uint8_t*)f.data;
+			pack.insert(pack.end(),data,data + f.len);
+			packed_frame p = { (size_t)index, f };
+			packed.push_back(p);
+			c.queue.pop_front();
 		}
-	
-		if(header->len + sizeof(header_t) > len) {
-			std::cerr << "incorrect header len = " << header->len << " with full len = " << len << std::endl;
-			return;
+		if(packed.empty()) return;
+		
+		if(rate) {
+			tokens -= pack.size();
 		}
 		
-		std::cerr << usb::format_bytes(header->data, header->len).get() << std::endl;
+		busy = true;
+		int ret = link(&pack[0],pack.size(),[this](int status, size_t) {
+			this->completed(status);
+		});
+		if(ret < 0) {
+			LOG_WARNING(dmx,"link send of %zu frames failed: %i",packed.size(),ret);
+			completed(ret);
+		}
+	}
+}
 
-		streams[header->addr - 1]->data_received(header->data, header->len);
-		
-		size_t diff = sizeof(header_t) + header->len;
-		d += diff;
-		len -= diff;
+void dmx_scheduler::completed(int status) {
+	std::vector<packed_frame> done;
+	done.swap(packed);
+	busy = false;
+	
+	// the callbacks usually queue the next frame of their channel
+	for(auto &p : done) {
+		p.f.callback(status,p.f.len);
 	}
+	pump();
+}
+
+/* ------------------------------------ */
+
+serial_dmx::serial_dmx(boost::asio::io_service &io_svc)
+:serial(io_svc,"/dev/ttyUSB1"),
+ scheduler(io_svc,[this](void *data, size_t len, base_stream::send_callback cb) {
+	return this->serial.send(data,len,cb);
+ },7),
+ mux([this](size_t channel, void *data, size_t len, base_stream::send_callback cb) {
+	return this->scheduler.send(channel,data,len,cb);
+ },6,&io_svc) {
+	// link layer control frames (acknowledgements) go ahead of data
+	scheduler.set_channel(6,1000,1);
+	
+	// two frames ahead keeps the UART busy between writes
+	scheduler.set_rate(serial.byte_rate(),2 * sizeof(dmx_stream::buffer_t));
+	mux.set_line_rate(serial.byte_rate(),scheduler.get_pack_limit());
+	
+	connection = serial.buffer_received.connect([this](shared_buffer buffer) {
+		return this->mux.dispatch(buffer);
+	});
+}
+
+serial_dmx::~serial_dmx() {
+	LOG_DEBUG(dmx,"~serial_dmx");
+	connection.disconnect();
 }
 
 boost::shared_ptr<base_stream> serial_dmx::get_stream(size_t i) {
-	return streams[i];
+	return mux.get_stream(i);
+}
+
+void serial_dmx::set_channel(size_t i, int priority, uint32_t weight) {
+	scheduler.set_channel(i,priority,weight);
+}
+
+void serial_dmx::log_stats() const {
+	mux.log_stats();
 }
 
 serial_dmx::operator bool() const {
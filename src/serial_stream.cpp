@@ -1,34 +1,38 @@
 #include <serial_stream.h>
 
-#include <iostream>
+#include <log.h>
+#include <capture.h>
+#include <usb_trace.h>
 #include <sstream>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/bind.hpp>
 
 serial_stream::serial_stream(boost::asio::io_service &io_svc, const char *_path, const char *_opts)
-:serial(io_svc),reviver(io_svc),path(_path),opts(_opts) {
+:serial(io_svc),reviver(io_svc),path(_path),opts(_opts),
+ read_pool(buffer_pool::create(256,4)),read_buf(read_pool->acquire()) {
+	std::istringstream json_src(opts);
+		
+	boost::property_tree::ptree options;
+	boost::property_tree::read_json(json_src,options);
+		
+	baud = options.get<int>("baud");
+	parity = options.get<int>("parity");
+	
 	open_serial();		
 }
 
 bool serial_stream::open_serial() {
-	std::cerr << "opening serial port" << std::endl;
+	LOG_INFO(stream,"opening serial port %s",path.c_str());
 	boost::system::error_code open_error;
 	serial.open(path, open_error);
 	if(open_error) {
-		std::cerr << "open error: " << open_error.message() << std::endl;
+		LOG_ERROR(stream,"open error: %s",open_error.message().c_str());
 		return false;
 	}
 		
-	std::istringstream json_src(opts);
-		
-	boost::property_tree::ptree options;
-	boost::property_tree::read_json(json_src,options);
-		
-	int baud = options.get<int>("baud");
-	std::cerr << "baud: " << baud << std::endl;
-	int parity = options.get<int>("parity");
-	std::cerr << "parity: " << parity << std::endl;
+	LOG_INFO(stream,"baud: %i",baud);
+	LOG_INFO(stream,"parity: %i",parity);
 		
 	using boost::asio::serial_port_base;
 		
@@ -53,30 +57,36 @@ void serial_stream::setup_reviver() {
 
 void serial_stream::reviver_callback(const boost::system::error_code &error) {
 	if(!error) {
-		std::cerr << "reviver_callback" << std::endl;
+		LOG_DEBUG(stream,"reviver_callback");
 		if(!this->serial.is_open()) {
 			if(!open_serial()) {
-				std::cerr << "reviver next" << std::endl;
+				LOG_DEBUG(stream,"reviver next");
 				setup_reviver();
 			}
 		}
 	} else {
-		std::cerr << "reviver_callback cancelled: " << error.message() << std::endl;
+		LOG_DEBUG(stream,"reviver_callback cancelled: %s",error.message().c_str());
 		return;
 	}
 }
 
 void serial_stream::read_callback(size_t bytes_transferred, const boost::system::error_code &error) {
 	if(error) {
-		std::cerr << "read_callback error" << ": " << error << error.message() << ": " << std::endl;
+		LOG_ERROR(stream,"read_callback error: %i %s",error.value(),error.message().c_str());
 		boost::system::error_code close_error;
 		serial.close(close_error);
 		if(close_error) {
-			std::cerr << "serial_stream close error: " << error.message() << std::endl;
+			LOG_ERROR(stream,"serial_stream close error: %s",close_error.message().c_str());
 		}
 		setup_reviver();
 	} else {
-		data_received(read_buf,bytes_transferred);
+		shared_buffer chunk = read_buf.slice(0,bytes_transferred);
+		chunk.set_timestamp(usb::monotonic_ns());
+		if(capture *cap = capture::instance()) {
+			cap->stream(capture::serial_rx,serial.native_handle(),chunk.data(),chunk.size());
+		}
+		read_buf = read_pool->acquire();
+		deliver(chunk);
 		initiate_read();
 	}
 }
@@ -89,7 +99,7 @@ bool serial_stream::check_callback(size_t bytes_transferred, const boost::system
 void serial_stream::initiate_read() {
 	namespace ph = boost::asio::placeholders;
 		
-	boost::asio::async_read(serial,boost::asio::buffer(read_buf),
+	boost::asio::async_read(serial,boost::asio::buffer(read_buf.data(),read_buf.size()),
 		boost::bind(&serial_stream::check_callback,this,ph::bytes_transferred,ph::error),
 		boost::bind(&serial_stream::read_callback,this,ph::bytes_transferred,ph::error));	
 }
@@ -100,9 +110,19 @@ int serial_stream::send(void *data, size_t len, base_stream::send_callback callb
 		initiate_read();
 	}
 
+	if(capture *cap = capture::instance()) {
+		cap->stream(capture::serial_tx,serial.native_handle(),data,len);
+	}
+
 	boost::asio::async_write(serial,boost::asio::buffer(data,len),
 		[callback](const boost::system::error_code &error, size_t bytes_transferred) {
 			callback(error ? -1 : 0,bytes_transferred);										
 		});
 	return 0;
+}
+
+uint32_t serial_stream::byte_rate() const {
+	using boost::asio::serial_port_base;
+	const int bits = 1 + 8 + (parity != serial_port_base::parity::none ? 1 : 0) + 1;
+	return baud / bits;
 }
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include <shared_buffer.h>
+
+#include <algorithm>
+
+/* ------------------------------------ */
+
+buffer_block::buffer_block(boost::weak_ptr<buffer_pool> _pool, size_t _capacity)
+:refs(0),pool(_pool),capacity(_capacity),data(new uint8_t[_capacity])
+{
+
+}
+
+buffer_block::~buffer_block() {
+	delete[] data;
+}
+
+void intrusive_ptr_add_ref(buffer_block *block) {
+	block->refs.fetch_add(1,std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(buffer_block *block) {
+	if(block->refs.fetch_sub(1,std::memory_order_acq_rel) != 1) return;
+	
+	if(buffer_pool::pointer pool = block->pool.lock()) {
+		pool->recycle(block);
+	} else {
+		delete block;
+	}
+}
+
+/* ------------------------------------ */
+
+shared_buffer::shared_buffer():ptr(0),len(0),stamp(0) {
+
+}
+
+shared_buffer::shared_buffer(boost::intrusive_ptr<buffer_block> _block, size_t _len)
+:block(_block),ptr(_block ? _block->data : 0),len(_block ? std::min(_len,_block->capacity) : 0),stamp(0)
+{
+
+}
+
+uint8_t* shared_buffer::data() const {
+	return ptr;
+}
+
+size_t shared_buffer::size() const {
+	return len;
+}
+
+size_t shared_buffer::capacity() const {
+	return block ? block->capacity - (ptr - block->data) : 0;
+}
+
+shared_buffer shared_buffer::slice(size_t offset, size_t length) const {
+	shared_buffer s(*this);
+	offset = std::min(offset,len);
+	s.ptr += offset;
+	s.len = std::min(length,len - offset);
+	return s;
+}
+
+shared_buffer shared_buffer::slice(size_t offset) const {
+	return slice(offset,len);
+}
+
+uint64_t shared_buffer::timestamp() const {
+	return stamp;
+}
+
+void shared_buffer::set_timestamp(uint64_t ns) {
+	stamp = ns;
+}
+
+shared_buffer::operator bool() const {
+	return block.get() != 0;
+}
+
+/* ------------------------------------ */
+
+buffer_pool::buffer_pool(size_t _block_size):block_size(_block_size) {
+
+}
+
+buffer_pool::pointer buffer_pool::create(size_t block_size, size_t prealloc) {
+	pointer pool(new buffer_pool(block_size));
+	
+	for(size_t i = 0; i < prealloc; i++) {
+		pool->free_blocks.push_back(new buffer_block(pool,block_size));
+	}
+	
+	return pool;
+}
+
+buffer_pool::~buffer_pool() {
+	for(auto block : free_blocks) {
+		delete block;
+	}
+}
+
+void buffer_pool::recycle(buffer_block *block) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	free_blocks.push_back(block);
+}
+
+shared_buffer buffer_pool::acquire() {
+	buffer_block *block = 0;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if(!free_blocks.empty()) {
+			block = free_blocks.back();
+			free_blocks.pop_back();
+		}
+	}
+	
+	if(!block) {
+		block = new buffer_block(shared_from_this(),block_size);
+	}
+	
+	return shared_buffer(boost::intrusive_ptr<buffer_block>(block),block_size);
+}
+
+size_t buffer_pool::get_block_size() const {
+	return block_size;
+}
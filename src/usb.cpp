@@ -1,9 +1,17 @@
 #include <usb.h>
+#include <log.h>
+#include <capture.h>
+#include <usb_trace.h>
+#include <usb_stats.h>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/thread.hpp>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <string.h>
 
 using namespace usb;
 
-const int log_level = (getenv("DEBUG_USB") != 0);
-
 /* ------------------------------------ */	
 
 boost::shared_array<char> usb::format_bytes(const void *data, size_t len)
@@ -20,29 +28,101 @@ boost::shared_array<char> usb::format_bytes(const void *data, size_t len)
 
 /* ------------------------------------ */	
 
+static void capture_transfer(capture *cap, char event, const libusb_transfer *t) {
+	libusb_device *dev = libusb_get_device(t->dev_handle);
+	const bool in = t->endpoint & LIBUSB_ENDPOINT_IN;
+	const bool control = t->type == LIBUSB_TRANSFER_TYPE_CONTROL;
+	
+	const uint8_t *setup = (control && event == 'S') ? t->buffer : 0;
+	const uint8_t *data = control ? t->buffer + sizeof(libusb_control_setup) : t->buffer;
+	const uint32_t length = control ? t->length - sizeof(libusb_control_setup) : t->length;
+	
+	size_t data_len = 0;
+	if(event == 'S' && !in) data_len = length;
+	if(event == 'C' && in)  data_len = t->actual_length;
+	
+	cap->usb((uintptr_t)t,event,t->type,t->endpoint,
+	         libusb_get_device_address(dev),libusb_get_bus_number(dev),
+	         t->status,event == 'S' ? length : t->actual_length,
+	         setup,data,data_len);
+}
+
+// ids of synchronous transfers, pairing their submit and completion
+// records in traces and captures; bit 63 keeps them apart from the
+// transfer pointers used as ids of asynchronous ones
+static uint64_t sync_transfer_id() {
+	static std::atomic<uint64_t> next(0);
+	return (1ull << 63) | ++next;
+}
+
+// called before the libusb call with setup set for control transfers,
+// after it with the result in ret and transferred
+static void capture_sync(capture *cap, char event, uint64_t id, libusb_device_handle *handle,
+                         uint8_t type, uint8_t endpoint, const uint8_t *setup,
+                         const void *data, int length, int ret = 0, int transferred = 0)
+{
+	libusb_device *dev = libusb_get_device(handle);
+	const uint8_t devnum = libusb_get_device_address(dev);
+	const uint16_t busnum = libusb_get_bus_number(dev);
+	const bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	
+	if(event == 'S') {
+		cap->usb(id,'S',type,endpoint,devnum,busnum,0,length,setup,data,in ? 0 : length);
+	} else {
+		cap->usb(id,ret < 0 ? 'E' : 'C',type,endpoint,devnum,busnum,
+		         ret < 0 ? ret : 0,transferred,0,data,in ? transferred : 0);
+	}
+}
+
+/* ------------------------------------ */	
+
 const char* error_name(int error_code) {
 	return libusb_error_name(error_code);
 }
 
 /* ------------------------------------ */	
 
-context::context(int debug_level) {
-	fprintf(stderr,"libusb_init\n");
+context::context(int debug_level, bool hotplug) {
+	LOG_DEBUG(usb,"libusb_init");
 	
 	libusb_context *_ctx;
 	int ret = libusb_init(&_ctx);
 	if(ret) {
-		fprintf(stderr,"libusb_init failed with [%i]\n",ret);	
+		LOG_ERROR(usb,"libusb_init failed with [%i]",ret);	
 		return;
 	}	
 	
 	auto deleter = [](libusb_context *ctx) {
-		fprintf(stderr,"libusb_exit[%p]\n",ctx);
+		LOG_DEBUG(usb,"libusb_exit[%p]",ctx);
 		libusb_exit(ctx);	
 	};
 	ctx = boost::shared_ptr<libusb_context>(_ctx,deleter);
 	
 	libusb_set_debug(ctx.get(),debug_level);
+	
+	if(hotplug) {
+		enable_hotplug();
+	}
+}
+
+bool context::enable_hotplug() {
+	if(!ctx) return false;
+	if(hotplug) return true;
+	
+	if(!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		LOG_WARNING(usb,"libusb hotplug is not supported on this platform");
+		return false;
+	}
+	
+	boost::shared_ptr<device_registry> registry(new device_registry(ctx));
+	if(!*registry) return false;
+	
+	hotplug = registry;
+	return true;
+}
+
+device_registry* context::registry() const {
+	return hotplug.get();
 }
 
 
@@ -80,28 +160,28 @@ int device_handle::configuration() const {
 
 void device_handle::deleter(libusb_device_handle *handle) {
 	if(handle) {
-		fprintf(stderr,"libusb_close[%p]\n",handle);
+		LOG_DEBUG(usb,"libusb_close[%p]",handle);
 		libusb_close(handle);
 	}
 }
 
 device_handle::device_handle(device &dev, bool reset) {
 	if(!dev) {
-		fprintf(stderr,"There is no device to open.\n");
+		LOG_ERROR(usb,"There is no device to open.");
 		return;
 	}
 	
 	libusb_device_handle *_handle = 0;
 	int ret = libusb_open(dev,&_handle);
 	if(ret) {
-		fprintf(stderr,"Unable to open usb device\n");
+		LOG_ERROR(usb,"Unable to open usb device");
 		return;
 	}
 	
 	if(reset) {
 		int ret = libusb_reset_device(_handle);
 		if(ret) {
-			fprintf(stderr,"libusb_reset_device(%p) -> %s\n",_handle,libusb_error_name(ret));
+			LOG_ERROR(usb,"libusb_reset_device(%p) -> %s",_handle,libusb_error_name(ret));
 			libusb_close(_handle);
 			return;
 		}
@@ -110,7 +190,7 @@ device_handle::device_handle(device &dev, bool reset) {
 	handle = boost::shared_ptr<libusb_device_handle>(_handle,deleter);	
 	
 	if(libusb_kernel_driver_active(handle.get(),0)) {
-		fprintf(stderr,"Kernel driver active on usb device. Detaching...\n");
+		LOG_INFO(usb,"Kernel driver active on usb device. Detaching...");
 		libusb_detach_kernel_driver(handle.get(),0);
 	}	
 }
@@ -137,6 +217,30 @@ int device_handle::control_transfer(uint8_t bmRequestType,
 						 uint16_t wLength,
 						 unsigned int timeout)
 {
+	const bool in = bmRequestType & LIBUSB_ENDPOINT_IN;
+	const uint64_t id = sync_transfer_id();
+	
+	// laid out as the buffer of an asynchronous control transfer: the
+	// setup packet followed by the data
+	trace_recorder *recorder = trace_recorder::instance();
+	std::vector<uint8_t> traced;
+	if(recorder) {
+		traced.resize(sizeof(libusb_control_setup) + wLength);
+		libusb_fill_control_setup(&traced[0],bmRequestType,bRequest,wValue,wIndex,wLength);
+		if(!in && wLength) {
+			memcpy(&traced[sizeof(libusb_control_setup)],data,wLength);
+		}
+		recorder->record(trace_submit,id,LIBUSB_TRANSFER_TYPE_CONTROL,in ? LIBUSB_ENDPOINT_IN : 0,
+		                 0,traced.size(),0,&traced[0],in ? sizeof(libusb_control_setup) : traced.size());
+	}
+	
+	capture *cap = capture::instance();
+	if(cap) {
+		libusb_control_setup setup = { bmRequestType, bRequest, wValue, wIndex, wLength };
+		capture_sync(cap,'S',id,handle.get(),LIBUSB_TRANSFER_TYPE_CONTROL,in ? LIBUSB_ENDPOINT_IN : 0,
+		             (const uint8_t*)&setup,data,wLength);
+	}
+	
 	int ret = libusb_control_transfer(handle.get(),bmRequestType,
 	                                               bRequest,
 												   wValue,
@@ -145,14 +249,25 @@ int device_handle::control_transfer(uint8_t bmRequestType,
 												   wLength,
 												   timeout);
 											
-	if(log_level) {	   
-		auto bytes = format_bytes(data,wLength);
+	if(recorder) {
+		const int actual = ret < 0 ? 0 : ret;
+		if(in && actual) {
+			memcpy(&traced[sizeof(libusb_control_setup)],data,actual);
+		}
+		recorder->record(trace_complete,id,LIBUSB_TRANSFER_TYPE_CONTROL,in ? LIBUSB_ENDPOINT_IN : 0,
+		                 ret < 0 ? ret : 0,traced.size(),actual,
+		                 &traced[0],in ? sizeof(libusb_control_setup) + actual : 0);
+	}
 	
-		printf("C(0x%hhX,0x%hhX,0x%hX,0x%hX,[%s],%hi,%i)=%i(%s)\n",
-		 bmRequestType,bRequest,wValue,wIndex,bytes.get(),wLength,timeout,ret,
-		 ret < 0 ? libusb_error_name(ret) : "");
+	if(cap) {
+		capture_sync(cap,'C',id,handle.get(),LIBUSB_TRANSFER_TYPE_CONTROL,in ? LIBUSB_ENDPOINT_IN : 0,
+		             0,data,wLength,ret,ret < 0 ? 0 : ret);
 	}
 	
+	LOG_DEBUG(usb,"C(0x%hhX,0x%hhX,0x%hX,0x%hX,[%s],%hi,%i)=%i(%s)",
+	 bmRequestType,bRequest,wValue,wIndex,format_bytes(data,wLength).get(),wLength,timeout,ret,
+	 ret < 0 ? libusb_error_name(ret) : "");
+	
 	return ret;
 }
 
@@ -164,17 +279,40 @@ int device_handle::bulk_transfer(uint8_t endpoint,
 								 int *transferred,
 								 unsigned int timeout)
 {
+	const bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	const uint64_t id = sync_transfer_id();
+	
+	trace_recorder *recorder = trace_recorder::instance();
+	if(recorder) {
+		recorder->record(trace_submit,id,LIBUSB_TRANSFER_TYPE_BULK,endpoint,0,length,0,
+		                 data,in ? 0 : length);
+	}
+	
+	capture *cap = capture::instance();
+	if(cap) {
+		capture_sync(cap,'S',id,handle.get(),LIBUSB_TRANSFER_TYPE_BULK,endpoint,0,data,length);
+	}
+	
 	int ret = libusb_bulk_transfer(handle.get(),endpoint,
 	                                         (unsigned char*)data,
 											 length,
 											 transferred,
 											 timeout);
+	
+	if(recorder) {
+		const int actual = transferred ? *transferred : 0;
+		recorder->record(trace_complete,id,LIBUSB_TRANSFER_TYPE_BULK,endpoint,ret,length,actual,
+		                 data,in ? actual : 0);
+	}
 											 
-	/*auto bytes = format_bytes(data,length);
+	if(cap) {
+		capture_sync(cap,'C',id,handle.get(),LIBUSB_TRANSFER_TYPE_BULK,endpoint,0,
+		             data,length,ret,transferred ? *transferred : 0);
+	}
 	
-	printf("B(0x%hhX,[%s],%i,%i,%i)=%i(%s)\n",
-	 endpoint,bytes.get(),length,*transferred,timeout,ret,
-	 ret < 0 ? libusb_error_name(ret) : "");*/
+	LOG_TRACE(usb,"B(0x%hhX,[%s],%i,%i,%i)=%i(%s)",
+	 endpoint,format_bytes(data,length).get(),length,transferred ? *transferred : 0,timeout,ret,
+	 ret < 0 ? libusb_error_name(ret) : "");
 	return ret;						 
 }
 
@@ -225,12 +363,12 @@ config_descriptor::config_descriptor(libusb_device *dev) {
 	libusb_config_descriptor *_desc;
 	int ret = libusb_get_active_config_descriptor(dev,&_desc);
 	if(ret < 0) {
-		printf("libusb_get_active_config_descriptor -> %s\n",libusb_error_name(ret));
+		LOG_ERROR(usb,"libusb_get_active_config_descriptor -> %s",libusb_error_name(ret));
 		return;
 	}
 
 	auto deleter = [](libusb_config_descriptor *desc) {
-		printf("libusb_free_config_descriptor[%p]\n",desc);	
+		LOG_TRACE(usb,"libusb_free_config_descriptor[%p]",desc);	
 		libusb_free_config_descriptor(desc);
 	};
 	
@@ -241,6 +379,24 @@ libusb_config_descriptor* config_descriptor::operator->() const {
 	return desc.get();
 }
 
+int config_descriptor::max_packet_size(uint8_t endpoint) const {
+	if(!desc) return -1;
+	
+	for(int i = 0; i < desc->bNumInterfaces; i++) {
+		const libusb_interface &iface = desc->interface[i];
+		for(int j = 0; j < iface.num_altsetting; j++) {
+			const libusb_interface_descriptor &alt = iface.altsetting[j];
+			for(int k = 0; k < alt.bNumEndpoints; k++) {
+				if(alt.endpoint[k].bEndpointAddress == endpoint) {
+					return alt.endpoint[k].wMaxPacketSize & 0x7ff;
+				}
+			}
+		}
+	}
+	
+	return -1;
+}
+
 config_descriptor::operator bool() const {
 	return desc;
 }
@@ -248,34 +404,34 @@ config_descriptor::operator bool() const {
 /* ------------------------------------ */
 
 device::device(libusb_device *_dev):dev(_dev) {
-	printf("device::device[%p]\n",_dev	);
+	LOG_TRACE(usb,"device::device[%p]",_dev);
 	if(dev) {
-		printf("libusb_ref_device(new)\n");
+		LOG_TRACE(usb,"libusb_ref_device(new)");
 		libusb_ref_device(dev);
 	}
 }
 
 device::device(const device &d) {
-	printf("libusb_ref_device(copy)\n");
+	LOG_TRACE(usb,"libusb_ref_device(copy)");
 	dev = d.dev;
 	libusb_ref_device(dev);
 }
 
 device::device(device &&d) {
-	printf("device move\n");
+	LOG_TRACE(usb,"device move");
 	dev = d.dev;
 	d.dev = nullptr;
 }
 
 device& device::operator=(const device &d) {
-	printf("device::operator=\n");
+	LOG_TRACE(usb,"device::operator=");
 	dev = d.dev;
 	libusb_ref_device(dev);
 }
 
 device::~device() {
 	if(dev) {
-		printf("libusb_unref_device\n");
+		LOG_TRACE(usb,"libusb_unref_device");
 		libusb_unref_device(dev);
 	}
 }
@@ -294,17 +450,193 @@ device_descriptor device::descriptor() const {
 	return device_descriptor(dev);
 }
 
+static std::string format_port_path(libusb_device *dev) {
+	uint8_t ports[8];
+	int count = libusb_get_port_numbers(dev,ports,sizeof(ports));
+	
+	char path[64];
+	int len = snprintf(path,sizeof(path),"%hhu",libusb_get_bus_number(dev));
+	for(int i = 0; i < count && len < (int)sizeof(path); i++) {
+		len += snprintf(path + len,sizeof(path) - len,"%c%hhu",i ? '.' : '-',ports[i]);
+	}
+	
+	return path;
+}
+
+std::string device::port_path() const {
+	return dev ? format_port_path(dev) : std::string();
+}
+
+std::string device::read_serial() const {
+	if(!dev) return std::string();
+	
+	device_descriptor desc(dev);
+	if(!desc || !desc.iSerialNumber) return std::string();
+	
+	libusb_device_handle *handle = 0;
+	if(libusb_open(dev,&handle)) return std::string();
+	
+	unsigned char serial[128];
+	int ret = libusb_get_string_descriptor_ascii(handle,desc.iSerialNumber,serial,sizeof(serial));
+	libusb_close(handle);
+	
+	return ret > 0 ? std::string((char*)serial,ret) : std::string();
+}
+
+/* ------------------------------------ */
+
+device_registry::entry::entry(libusb_device *_dev)
+:dev(_dev),vid(0),pid(0),path(dev.port_path()),serial_read(false)
+{
+	device_descriptor desc(_dev);
+	if(desc) {
+		vid = desc.idVendor;
+		pid = desc.idProduct;
+	}
+}
+
+device_registry::device_registry(boost::shared_ptr<libusb_context> _ctx):ctx(_ctx) {
+	// ENUMERATE delivers already attached devices before register returns
+	ret = libusb_hotplug_register_callback(ctx.get(),
+		(libusb_hotplug_event)(LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+		LIBUSB_HOTPLUG_ENUMERATE,
+		LIBUSB_HOTPLUG_MATCH_ANY,LIBUSB_HOTPLUG_MATCH_ANY,LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_callback,this,&callback_handle);
+	
+	if(ret) {
+		LOG_ERROR(usb,"libusb_hotplug_register_callback -> %s",libusb_error_name(ret));
+	}
+}
+
+device_registry::~device_registry() {
+	if(ret == 0) {
+		libusb_hotplug_deregister_callback(ctx.get(),callback_handle);
+	}
+}
+
+int device_registry::hotplug_callback(libusb_context *,
+                                      libusb_device *dev,
+                                      libusb_hotplug_event event,
+                                      void *user_data)
+{
+	device_registry *registry = (device_registry*)user_data;
+	
+	if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		registry->arrived(dev);
+	} else if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		registry->left(dev);
+	}
+	
+	return 0;
+}
+
+void device_registry::arrived(libusb_device *dev) {
+	entry_ptr e(new entry(dev));
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if(by_device.count(dev)) return;
+		
+		by_device[dev] = e;
+		by_id.insert(std::make_pair((uint32_t)e->vid << 16 | e->pid,e));
+		by_path[e->path] = e;
+	}
+	
+	device_arrived(e->dev);
+}
+
+void device_registry::left(libusb_device *dev) {
+	entry_ptr e;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		auto i = by_device.find(dev);
+		if(i == by_device.end()) return;
+		
+		e = i->second;
+		by_device.erase(i);
+		
+		auto range = by_id.equal_range((uint32_t)e->vid << 16 | e->pid);
+		for(auto j = range.first; j != range.second; ++j) {
+			if(j->second == e) {
+				by_id.erase(j);
+				break;
+			}
+		}
+		
+		auto p = by_path.find(e->path);
+		if(p != by_path.end() && p->second == e) by_path.erase(p);
+		
+		auto s = by_serial.find(e->serial);
+		if(e->serial_read && s != by_serial.end() && s->second == e) by_serial.erase(s);
+	}
+	
+	device_left(e->dev);
+}
+
+std::vector<device> device_registry::find(uint16_t vid, uint16_t pid) const {
+	std::vector<device> devices;
+	
+	boost::lock_guard<boost::mutex> lock(mutex);
+	auto range = by_id.equal_range((uint32_t)vid << 16 | pid);
+	for(auto i = range.first; i != range.second; ++i) {
+		devices.push_back(i->second->dev);
+	}
+	return devices;
+}
+
+device device_registry::find_path(const std::string &path) const {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	auto i = by_path.find(path);
+	return i != by_path.end() ? i->second->dev : device(nullptr);
+}
+
+device device_registry::find_serial(const std::string &serial) {
+	std::vector<entry_ptr> unread;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		auto i = by_serial.find(serial);
+		if(i != by_serial.end()) return i->second->dev;
+		
+		for(auto &d : by_device) {
+			if(!d.second->serial_read) unread.push_back(d.second);
+		}
+	}
+	
+	// descriptors are read without the lock, hotplug events keep flowing
+	for(auto &e : unread) {
+		std::string s = e->dev.read_serial();
+		
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if(!by_device.count(e->dev) || e->serial_read) continue;
+		e->serial = s;
+		e->serial_read = true;
+		if(!s.empty()) by_serial[s] = e;
+	}
+	
+	boost::lock_guard<boost::mutex> lock(mutex);
+	auto i = by_serial.find(serial);
+	return i != by_serial.end() ? i->second->dev : device(nullptr);
+}
+
+size_t device_registry::count() const {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	return by_device.size();
+}
+
+device_registry::operator bool() const {
+	return ret == 0;
+}
+
 /* ------------------------------------ */
 
 interface::interface(device_handle _handle,int _interface_number)
 :handle(_handle),interface_number(_interface_number)
 {
-	printf("interface claim[%i]\n",interface_number);
+	LOG_DEBUG(usb,"interface claim[%i]",interface_number);
 	ret = handle.claim_interface(interface_number);
 }
 
 interface::~interface() {
-	printf("interface release[%i]\n",interface_number);
+	LOG_DEBUG(usb,"interface release[%i]",interface_number);
 	if(ret == 0) {
 		handle.release_interface(interface_number);
 	}
@@ -319,12 +651,12 @@ interface::operator bool() const {
 configuration::configuration(device_handle _handle, int _config_number)
 :handle(_handle),config_number(_config_number)
 {
-	printf("configuration set[%i]\n",config_number);
+	LOG_DEBUG(usb,"configuration set[%i]",config_number);
 	ret = handle.set_configuration(config_number);
 }
 
 configuration::~configuration() {
-	printf("configuration set[%i]\n",-1);
+	LOG_DEBUG(usb,"configuration set[%i]",-1);
 	handle.set_configuration(-1);
 }
 	
@@ -334,38 +666,97 @@ configuration::operator bool() const {
 
 /* ------------------------------------ */
 
-device_list::device_list(const context &ctx) {
-	printf("libusb_get_device_list\n");
+device_list::device_list(const context &ctx):serials_read(false) {
+	LOG_DEBUG(usb,"libusb_get_device_list");
 	count = libusb_get_device_list(ctx,&list);
 	if(count <= 0) {
-		printf("No usb devices found\n");
+		LOG_WARNING(usb,"No usb devices found");
 		count = 0;
 	} else {
-		printf("Found %i usb devices\n",count);
+		LOG_DEBUG(usb,"Found %zi usb devices",count);
+		build_index();
 	}
 }
 
 device_list::~device_list() {
 	if(count > 0) {
-		printf("libusb_free_device_list\n");
+		LOG_DEBUG(usb,"libusb_free_device_list");
 		libusb_free_device_list(list,1);
 	}
 }
 
+void device_list::build_index() {
+	descriptors.reserve(count);
+	
+	for(ssize_t i = 0; i < count; i++) {
+		descriptors.push_back(device_descriptor(list[i]));
+		
+		const device_descriptor &desc = descriptors.back();
+		if(desc) {
+			by_id.insert(std::make_pair((uint32_t)desc.idVendor << 16 | desc.idProduct,(size_t)i));
+		}
+		
+		by_path[format_port_path(list[i])] = i;
+	}
+}
+
+void device_list::read_serials() {
+	serials_read = true;
+	
+	std::vector<size_t> pending;
+	for(ssize_t i = 0; i < count; i++) {
+		if(descriptors[i] && descriptors[i].iSerialNumber) pending.push_back(i);
+	}
+	
+	// opening a device and reading a string descriptor costs a few
+	// control round trips, overlap them across a handful of threads
+	const size_t workers = std::min<size_t>(pending.size(),8);
+	std::vector<std::string> serials(pending.size());
+	
+	boost::thread_group threads;
+	for(size_t w = 0; w < workers; w++) {
+		threads.create_thread([&,w]() {
+			for(size_t j = w; j < pending.size(); j += workers) {
+				serials[j] = device(list[pending[j]]).read_serial();
+			}
+		});
+	}
+	threads.join_all();
+	
+	for(size_t j = 0; j < pending.size(); j++) {
+		if(!serials[j].empty()) by_serial[serials[j]] = pending[j];
+	}
+}
+
 ssize_t device_list::get_count() const {
 	return count;
 }
 
 device device_list::find(uint16_t vid, uint16_t pid) {
+	auto range = by_id.equal_range((uint32_t)vid << 16 | pid);
+	return range.first != range.second ? list[range.first->second] : nullptr;
+}
 
-	auto checker = [&vid,&pid](device_descriptor desc) {
-		return desc.idVendor == vid && desc.idProduct == pid;
-	};
+std::vector<device> device_list::find_all(uint16_t vid, uint16_t pid) {
+	std::vector<device> devices;
+	
+	auto range = by_id.equal_range((uint32_t)vid << 16 | pid);
+	for(auto i = range.first; i != range.second; ++i) {
+		devices.push_back(list[i->second]);
+	}
+	return devices;
+}
+
+device device_list::find_path(const std::string &path) {
+	auto i = by_path.find(path);
+	return i != by_path.end() ? list[i->second] : nullptr;
+}
 
-	std::vector<libusb_device*> devices(list,list + count);
-	auto dev = std::find_if(devices.begin(),devices.end(),checker);
+device device_list::find_serial(const std::string &serial) {
+	if(!serials_read) read_serials();
 	
-	return dev != devices.end() ? *dev : nullptr;
+	auto i = by_serial.find(serial);
+	return i != by_serial.end() ? list[i->second] : nullptr;
 }
 
 /* ------------------------------------ */
@@ -373,12 +764,12 @@ device device_list::find(uint16_t vid, uint16_t pid) {
 void transfer::init_native_transfer() {
 	libusb_transfer *_tr = libusb_alloc_transfer(0);
 	if(!_tr) {
-		fprintf(stderr,"Unable to allocate transfer\n");
+		LOG_ERROR(usb,"Unable to allocate transfer");
 		return;	
 	}
 	
 	auto deleter = [](libusb_transfer *t) {
-		if(log_level) fprintf(stderr,"libusb_free_transfer[%p]\n",t);
+		LOG_TRACE(usb,"libusb_free_transfer[%p]",t);
 		
 		/*if(int ret = libusb_cancel_transfer(t)) {
 			fprintf(stderr,"libusb_cancel_transfer[%s]\n",libusb_error_name(ret));
@@ -396,6 +787,10 @@ transfer::transfer(device_handle _dev,
 			       uint8_t flags,
 			       unsigned int timeout)
 :dev(_dev)
+,completion_hook(0)
+,completion_arg(0)
+,submit_ns(0)
+,complete_ns(0)
 {
 	init_native_transfer();
 	
@@ -412,7 +807,7 @@ transfer::transfer(device_handle _dev,
 }
 
 transfer::~transfer() {
-	if(log_level) fprintf(stderr,"~transfer\n");
+	LOG_TRACE(usb,"~transfer");
 }
 
 transfer::operator bool() const {
@@ -423,17 +818,77 @@ void transfer::generic_callback(libusb_transfer *native_transfer) {
 	//fprintf(stderr,"transfer::generic_callback[%p]\n",native_transfer);
 	
 	transfer *wrapper = (transfer*)native_transfer->user_data;	
-	if(log_level) {
-		fprintf(stderr,"transfer_completed[%s][%i/%i]\n",wrapper->status_str(),
-	                                                     wrapper->actual_length(),
-			    										 wrapper->length());
+	wrapper->complete_ns = monotonic_ns();
+	
+	LOG_DEBUG(usb,"transfer_completed[%s][%i/%i]",wrapper->status_str(),
+	                                             wrapper->actual_length(),
+	                                             wrapper->length());
+	
+	if(trace_recorder *recorder = trace_recorder::instance()) {
+		const bool in = native_transfer->endpoint & LIBUSB_ENDPOINT_IN;
+		size_t payload_length = in ? native_transfer->actual_length : 0;
+		if(in && native_transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			payload_length += sizeof(libusb_control_setup);
+		}
+		recorder->record(trace_complete,(uintptr_t)native_transfer,
+		                 native_transfer->type,native_transfer->endpoint,
+		                 native_transfer->status,native_transfer->length,
+		                 native_transfer->actual_length,
+		                 native_transfer->buffer,payload_length);
+	}
+	
+	if(capture *cap = capture::instance()) {
+		capture_transfer(cap,'C',native_transfer);
 	}
 	
+	transfer_stats::instance().completed(native_transfer->type,native_transfer->endpoint,
+	                                     native_transfer->status,
+	                                     wrapper->complete_ns - wrapper->submit_ns);
+	
 	wrapper->transfer_completed(wrapper);
+	
+	// last, the hook may resume code that frees the transfer
+	if(void (*hook)(transfer*,void*) = wrapper->completion_hook) {
+		wrapper->completion_hook = 0;
+		hook(wrapper,wrapper->completion_arg);
+	}
+}
+
+void transfer::set_completion_hook(void (*hook)(transfer *tr, void *arg), void *arg) {
+	completion_hook = hook;
+	completion_arg = arg;
 }
 
 int transfer::submit() {
-	return libusb_submit_transfer(tr.get());
+	// logged before submitting, the completion may fire on another thread
+	trace_recorder *recorder = trace_recorder::instance();
+	if(recorder) {
+		const bool in = tr->endpoint & LIBUSB_ENDPOINT_IN;
+		size_t payload_length = in ? 0 : tr->length;
+		if(in && tr->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			payload_length = sizeof(libusb_control_setup);
+		}
+		recorder->record(trace_submit,(uintptr_t)tr.get(),tr->type,tr->endpoint,
+		                 0,tr->length,0,tr->buffer,payload_length);
+	}
+	
+	if(capture *cap = capture::instance()) {
+		capture_transfer(cap,'S',tr.get());
+	}
+	
+	submit_ns = monotonic_ns();
+	int ret = libusb_submit_transfer(tr.get());
+	
+	if(ret) {
+		transfer_stats::instance().submit_failed(tr->type,tr->endpoint);
+	}
+	
+	if(ret && recorder) {
+		recorder->record(trace_complete,(uintptr_t)tr.get(),tr->type,tr->endpoint,
+		                 ret,tr->length,0,0,0);
+	}
+	
+	return ret;
 }
 
 int transfer::cancel() {
@@ -455,11 +910,19 @@ void transfer::fill_control(uint8_t bmRequestType,
 										   wValue,
 										   wIndex,
 										   wLength);
-	memcpy(buffer.get() + sizeof(libusb_control_setup),data,wLength);
+	if(data) {
+		memcpy(buffer.get() + sizeof(libusb_control_setup),data,wLength);
+	} else {
+		memset(buffer.get() + sizeof(libusb_control_setup),0,wLength);
+	}
 	
 	set_buffer(buffer,buffer_len);
 }
 
+uint8_t* transfer::control_data() const {
+	return tr->buffer + sizeof(libusb_control_setup);
+}
+
 boost::shared_array<uint8_t> transfer::buffer() {
 	return data_buffer;
 }
@@ -470,15 +933,19 @@ void transfer::set_buffer(boost::shared_array<uint8_t> buffer,size_t len) {
 	tr->length = len;
 }
 
+uint8_t* transfer::data() const {
+	return tr->buffer;
+}
+
 void transfer::set_buffer(void *buffer, size_t len) {
-	set_buffer(boost::shared_array<uint8_t>((uint8_t*)buffer,[](uint8_t *) {
-		//fprintf(stderr,"shared_array stub delete\n");
-	}),len);
+	data_buffer.reset();
+	tr->buffer = (unsigned char*)buffer;
+	tr->length = len;
 }
 
 void transfer::allocate_buffer(size_t len) {
 	boost::shared_array<uint8_t> buffer(new uint8_t[len],[len](uint8_t *arr) {
-		fprintf(stderr,"deleting array[%p] len[%i]\n",arr,len);
+		LOG_TRACE(usb,"deleting array[%p] len[%zu]",arr,len);
 		delete[] arr;
 	});
 	set_buffer(buffer,len);
@@ -533,6 +1000,10 @@ int transfer::actual_length() const {
 	return tr->actual_length;
 }
 
+uint64_t transfer::completed_at() const {
+	return complete_ns;
+}
+
 unsigned int transfer::timeout() const {
 	return tr->timeout;
 }
@@ -0,0 +1,130 @@
+#include <usb_asio.h>
+#include <log.h>
+
+#include <poll.h>
+
+using namespace usb;
+
+asio_events::watch::watch(boost::asio::io_service &io, int fd, short _events)
+:descriptor(io,fd),events(_events),alive(true)
+{
+
+}
+
+/* ------------------------------------ */
+
+asio_events::asio_events(const context &_ctx, boost::asio::io_service &_io)
+:ctx(_ctx),io(_io),timer(_io),alive(new bool(true))
+{
+	libusb_set_pollfd_notifiers(ctx,pollfd_added,pollfd_removed,this);
+	
+	if(const libusb_pollfd **fds = libusb_get_pollfds(ctx)) {
+		for(const libusb_pollfd **i = fds; *i; i++) {
+			add((*i)->fd,(*i)->events);
+		}
+		libusb_free_pollfds(fds);
+	}
+	
+	arm_timer();
+}
+
+asio_events::~asio_events() {
+	libusb_set_pollfd_notifiers(ctx,0,0,0);
+	*alive = false;
+	
+	boost::system::error_code error;
+	timer.cancel(error);
+	
+	for(auto &w : watches) {
+		w.second->alive = false;
+		w.second->descriptor.cancel(error);
+		// the fd belongs to libusb
+		w.second->descriptor.release();
+	}
+}
+
+// notifiers may fire on any thread that calls into libusb,
+// descriptors are only touched on the io_service thread
+void asio_events::pollfd_added(int fd, short events, void *user_data) {
+	asio_events *self = (asio_events*)user_data;
+	boost::shared_ptr<bool> alive = self->alive;
+	self->io.dispatch([self,alive,fd,events]() {
+		if(*alive) self->add(fd,events);
+	});
+}
+
+void asio_events::pollfd_removed(int fd, void *user_data) {
+	asio_events *self = (asio_events*)user_data;
+	boost::shared_ptr<bool> alive = self->alive;
+	self->io.dispatch([self,alive,fd]() {
+		if(*alive) self->remove(fd);
+	});
+}
+
+void asio_events::add(int fd, short events) {
+	LOG_DEBUG(usb,"asio_events add fd[%i] events[0x%hX]",fd,events);
+	
+	remove(fd);
+	
+	watch_ptr w(new watch(io,fd,events));
+	watches[fd] = w;
+	if(events & POLLIN)  arm(w,POLLIN);
+	if(events & POLLOUT) arm(w,POLLOUT);
+}
+
+void asio_events::remove(int fd) {
+	auto i = watches.find(fd);
+	if(i == watches.end()) return;
+	
+	LOG_DEBUG(usb,"asio_events remove fd[%i]",fd);
+	
+	watch_ptr w = i->second;
+	watches.erase(i);
+	
+	boost::system::error_code error;
+	w->alive = false;
+	w->descriptor.cancel(error);
+	w->descriptor.release();
+}
+
+void asio_events::arm(watch_ptr w, short events) {
+	boost::shared_ptr<bool> alive = this->alive;
+	auto handler = [this,alive,w,events](const boost::system::error_code &error, size_t) {
+		if(error == boost::asio::error::operation_aborted || !*alive || !w->alive) return;
+		
+		this->handle_events();
+		if(w->alive) this->arm(w,events);
+	};
+	
+	// null_buffers turns the descriptor into a pure readiness notification
+	if(events & POLLIN) {
+		w->descriptor.async_read_some(boost::asio::null_buffers(),handler);
+	} else if(events & POLLOUT) {
+		w->descriptor.async_write_some(boost::asio::null_buffers(),handler);
+	}
+}
+
+void asio_events::arm_timer() {
+	struct timeval tv;
+	if(libusb_get_next_timeout(ctx,&tv) != 1) {
+		return;
+	}
+	
+	timer.expires_from_now(boost::posix_time::seconds(tv.tv_sec) +
+	                       boost::posix_time::microseconds(tv.tv_usec));
+	
+	boost::shared_ptr<bool> alive = this->alive;
+	timer.async_wait([this,alive](const boost::system::error_code &error) {
+		if(error == boost::asio::error::operation_aborted || !*alive) return;
+		this->handle_events();
+	});
+}
+
+void asio_events::handle_events() {
+	struct timeval tv = { 0, 0 };
+	libusb_handle_events_timeout_completed(ctx,&tv,0);
+	
+	// completions may have submitted transfers with earlier deadlines;
+	// on Linux libusb reports timeouts through a timerfd and this is a no-op
+	arm_timer();
+}
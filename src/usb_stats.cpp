@@ -0,0 +1,211 @@
+#include <usb_stats.h>
+#include <log.h>
+
+#include <libusb-1.0/libusb.h>
+#include <algorithm>
+
+using namespace usb;
+
+histogram_snapshot::histogram_snapshot()
+:count(0)
+,sum(0)
+,max(0)
+,buckets(HISTOGRAM_BUCKETS,0)
+{
+}
+
+uint64_t histogram_snapshot::percentile(double q) const {
+	if(!count) return 0;
+
+	uint64_t rank = (uint64_t)(q * count + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > count) rank = count;
+
+	uint64_t seen = 0;
+	for(size_t i = 0; i < buckets.size(); i++) {
+		seen += buckets[i];
+		if(seen >= rank) {
+			return std::min(histogram::bucket_upper_bound(i),max);
+		}
+	}
+	return max;
+}
+
+uint64_t histogram_snapshot::mean() const {
+	return count ? sum / count : 0;
+}
+
+void histogram_snapshot::merge(const histogram_snapshot &other) {
+	count += other.count;
+	sum += other.sum;
+	max = std::max(max,other.max);
+	for(size_t i = 0; i < buckets.size(); i++) {
+		buckets[i] += other.buckets[i];
+	}
+}
+
+/* ------------------------------------ */
+
+histogram::histogram()
+:sum(0)
+,max(0)
+{
+	for(auto &b : buckets) {
+		b.store(0,std::memory_order_relaxed);
+	}
+}
+
+size_t histogram::bucket_index(uint64_t value) {
+	const uint64_t sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+	if(value < sub_buckets) {
+		return value;
+	}
+
+	const int msb = 63 - __builtin_clzll(value);
+	const int shift = msb - HISTOGRAM_SUB_BITS;
+	return ((shift + 1) << HISTOGRAM_SUB_BITS) | ((value >> shift) & (sub_buckets - 1));
+}
+
+uint64_t histogram::bucket_upper_bound(size_t index) {
+	const uint64_t sub_buckets = 1 << HISTOGRAM_SUB_BITS;
+	if(index < sub_buckets) {
+		return index;
+	}
+
+	const int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+	const uint64_t lower = (sub_buckets | (index & (sub_buckets - 1))) << shift;
+	return lower + ((1ull << shift) - 1);
+}
+
+void histogram::record(uint64_t value) {
+	buckets[bucket_index(value)].fetch_add(1,std::memory_order_relaxed);
+	sum.fetch_add(value,std::memory_order_relaxed);
+
+	uint64_t current = max.load(std::memory_order_relaxed);
+	while(value > current &&
+	      !max.compare_exchange_weak(current,value,std::memory_order_relaxed));
+}
+
+// not atomic as a whole, a record() racing with it may show up in
+// the buckets but not in sum yet
+histogram_snapshot histogram::snapshot() const {
+	histogram_snapshot s;
+	for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		s.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		s.count += s.buckets[i];
+	}
+	s.sum = sum.load(std::memory_order_relaxed);
+	s.max = max.load(std::memory_order_relaxed);
+	return s;
+}
+
+/* ------------------------------------ */
+
+transfer_stats::endpoint_stats::endpoint_stats() {
+	for(auto &c : counters) {
+		c.store(0,std::memory_order_relaxed);
+	}
+}
+
+transfer_stats::transfer_stats() {
+	for(auto &type : endpoints) {
+		for(auto &e : type) {
+			e.store(0,std::memory_order_relaxed);
+		}
+	}
+}
+
+// endpoint addresses map to 0-15 for OUT and 16-31 for IN
+transfer_stats::endpoint_stats* transfer_stats::get(uint8_t type, uint8_t endpoint) {
+	std::atomic<endpoint_stats*> &slot =
+		endpoints[type & 3][(endpoint & 0x0f) | ((endpoint & LIBUSB_ENDPOINT_IN) ? 16 : 0)];
+
+	endpoint_stats *stats = slot.load(std::memory_order_acquire);
+	if(stats) {
+		return stats;
+	}
+
+	endpoint_stats *fresh = new endpoint_stats;
+	if(slot.compare_exchange_strong(stats,fresh,std::memory_order_acq_rel)) {
+		return fresh;
+	}
+	// another thread installed one first
+	delete fresh;
+	return stats;
+}
+
+void transfer_stats::completed(uint8_t type, uint8_t endpoint, int status, uint64_t latency_ns) {
+	endpoint_stats *stats = get(type,endpoint);
+
+	if(status >= 0 && status < stat_submit_failed) {
+		stats->counters[status].fetch_add(1,std::memory_order_relaxed);
+	} else {
+		stats->counters[stat_error].fetch_add(1,std::memory_order_relaxed);
+	}
+
+	if(status == LIBUSB_TRANSFER_COMPLETED) {
+		stats->latency.record(latency_ns);
+	}
+}
+
+void transfer_stats::submit_failed(uint8_t type, uint8_t endpoint) {
+	get(type,endpoint)->counters[stat_submit_failed].fetch_add(1,std::memory_order_relaxed);
+}
+
+std::vector<endpoint_stats_snapshot> transfer_stats::snapshot() const {
+	std::vector<endpoint_stats_snapshot> result;
+
+	for(size_t type = 0; type < 4; type++) {
+		for(size_t i = 0; i < 32; i++) {
+			endpoint_stats *stats = endpoints[type][i].load(std::memory_order_acquire);
+			if(!stats) continue;
+
+			endpoint_stats_snapshot s;
+			s.type = type;
+			s.endpoint = (i & 0x0f) | ((i & 16) ? LIBUSB_ENDPOINT_IN : 0);
+			for(size_t c = 0; c < stat_count; c++) {
+				s.counters[c] = stats->counters[c].load(std::memory_order_relaxed);
+			}
+			s.latency = stats->latency.snapshot();
+			result.push_back(s);
+		}
+	}
+
+	return result;
+}
+
+void transfer_stats::log() const {
+	for(auto &s : snapshot()) {
+		LOG_INFO(usb,"%s ep 0x%02hhX: %llu completed, p50 %lluus p99 %lluus p999 %lluus max %lluus, "
+		             "%llu timed out, %llu stalled, %llu cancelled, %llu overflows, "
+		             "%llu errors, %llu no device, %llu submit failures",
+		         transfer_type_name(s.type),s.endpoint,
+		         (unsigned long long)s.counters[stat_completed],
+		         (unsigned long long)s.latency.percentile(0.5) / 1000,
+		         (unsigned long long)s.latency.percentile(0.99) / 1000,
+		         (unsigned long long)s.latency.percentile(0.999) / 1000,
+		         (unsigned long long)s.latency.max / 1000,
+		         (unsigned long long)s.counters[stat_timed_out],
+		         (unsigned long long)s.counters[stat_stall],
+		         (unsigned long long)s.counters[stat_cancelled],
+		         (unsigned long long)s.counters[stat_overflow],
+		         (unsigned long long)s.counters[stat_error],
+		         (unsigned long long)s.counters[stat_no_device],
+		         (unsigned long long)s.counters[stat_submit_failed]);
+	}
+}
+
+transfer_stats& transfer_stats::instance() {
+	static transfer_stats stats;
+	return stats;
+}
+
+const char* usb::transfer_type_name(uint8_t type) {
+	switch(type) {
+		case LIBUSB_TRANSFER_TYPE_CONTROL:     return "control";
+		case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS: return "isochronous";
+		case LIBUSB_TRANSFER_TYPE_BULK:        return "bulk";
+		case LIBUSB_TRANSFER_TYPE_INTERRUPT:   return "interrupt";
+	}
+	return "unknown";
+}
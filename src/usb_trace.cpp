@@ -0,0 +1,121 @@
+#include <usb_trace.h>
+#include <log.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <boost/thread/lock_guard.hpp>
+
+using namespace usb;
+
+static const char trace_magic[4] = { 'A', 'K', 'T', 'R' };
+static const uint16_t trace_version = 1;
+
+uint64_t usb::monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ------------------------------------ */
+
+trace_recorder::trace_recorder(const char *path) {
+	file = fopen(path,"wb");
+	if(!file) {
+		LOG_ERROR(usb,"Unable to open usb trace file %s",path);
+		return;
+	}
+	
+	trace_file_header header;
+	memcpy(header.magic,trace_magic,sizeof(header.magic));
+	header.version = trace_version;
+	header.reserved = 0;
+	fwrite(&header,sizeof(header),1,file);
+}
+
+trace_recorder::~trace_recorder() {
+	if(file) fclose(file);
+}
+
+void trace_recorder::record(trace_event_t event, uint64_t id,
+                            uint8_t type, uint8_t endpoint,
+                            int status, int length, int actual_length,
+                            const void *payload, size_t payload_length)
+{
+	if(!file) return;
+	if(!payload) payload_length = 0;
+	
+	trace_record r;
+	r.timestamp = monotonic_ns();
+	r.id = id;
+	r.event = event;
+	r.type = type;
+	r.endpoint = endpoint;
+	r.reserved = 0;
+	r.status = status;
+	r.length = length;
+	r.actual_length = actual_length;
+	r.payload_length = payload_length;
+	
+	boost::lock_guard<boost::mutex> lock(mutex);
+	fwrite(&r,sizeof(r),1,file);
+	if(payload_length) fwrite(payload,payload_length,1,file);
+}
+
+trace_recorder::operator bool() const {
+	return file != 0;
+}
+
+trace_recorder* trace_recorder::instance() {
+	static trace_recorder *recorder = []() -> trace_recorder* {
+		const char *path = getenv("USB_TRACE");
+		if(!path) return 0;
+		
+		static trace_recorder r(path);
+		return r ? &r : 0;
+	}();
+	return recorder;
+}
+
+/* ------------------------------------ */
+
+trace_player::trace_player(const char *path) {
+	file = fopen(path,"rb");
+	if(!file) {
+		LOG_ERROR(usb,"Unable to open usb trace file %s",path);
+		return;
+	}
+	
+	trace_file_header header;
+	if(fread(&header,sizeof(header),1,file) != 1 ||
+	   memcmp(header.magic,trace_magic,sizeof(header.magic)) ||
+	   header.version != trace_version) {
+		LOG_ERROR(usb,"%s is not a usb trace file",path);
+		fclose(file);
+		file = 0;
+	}
+}
+
+trace_player::~trace_player() {
+	if(file) fclose(file);
+}
+
+bool trace_player::next(trace_record &record, std::vector<uint8_t> &payload) {
+	if(!file) return false;
+	
+	if(fread(&record,sizeof(record),1,file) != 1) {
+		return false;
+	}
+	
+	payload.resize(record.payload_length);
+	if(record.payload_length && fread(&payload[0],record.payload_length,1,file) != 1) {
+		LOG_WARNING(usb,"Truncated usb trace record");
+		return false;
+	}
+	
+	return true;
+}
+
+trace_player::operator bool() const {
+	return file != 0;
+}